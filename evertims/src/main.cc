@@ -47,7 +47,9 @@ using namespace std;
 void printUsage ()
 {
     cout << "Usage:\t\t./ims [-s inputport] [-v visualizationHost:port]";
-    cout << "[-a auralizationHost:port] [-g]" << endl;
+    cout << "[-a auralizationHost:port] [-g] [-r] [-j updateThreads]";
+    cout << "[-b nodesPerSolution] [-B nodesTotal] [-q] [-c treeCacheDirectory]";
+    cout << "[-M recentTreesMegabytes] [-G recentTreesGridStep] [-P] [-l latencyTargetMs]" << endl;
 }
 
 int main (int argc, char **argv)
@@ -55,10 +57,20 @@ int main (int argc, char **argv)
     char  room_file[256];
     char  material_file[256];
     bool  graphics = false;
+    bool  reciprocal = false;
+    bool  best_first = false;
+    bool  prediction = false;
+    int   update_threads = 1;
+    int   node_limit = 0;
+    int   total_node_limit = 0;
+    float recent_trees_mb = 0;
+    float recent_trees_grid = 0.01;
+    float latency_target = 0;
     int   input_socket = 1979;
     char  *auralization_addr = 0;
     char  *virchor_addr = 0;
     char  *print_addr = 0;
+    char  *tree_cache_dir = 0;
     char  tmp[256];
     float threshold_loc = 0.1;
     float threshold_rot = 0.01; // small threshold here, real threshold defined in geometry client 
@@ -70,13 +82,44 @@ int main (int argc, char **argv)
     int maxdepth = 5;
     
     int c, level;
-    while ((c = getopt (argc, argv, "f:gv:a:s:p:m:d:D:t:")) != EOF)
+    while ((c = getopt (argc, argv, "f:grqj:b:B:c:M:G:Pl:v:a:s:p:m:d:D:t:")) != EOF)
     {
         switch (c)
         {
             case 'g':
                 graphics = true;
                 break;
+            case 'r':
+                reciprocal = true;
+                break;
+            case 'q':
+                best_first = true;
+                break;
+            case 'j':
+                sscanf ( optarg, "%d", &update_threads );
+                break;
+            case 'b':
+                sscanf ( optarg, "%d", &node_limit );
+                break;
+            case 'B':
+                sscanf ( optarg, "%d", &total_node_limit );
+                break;
+            case 'c':
+                sscanf ( optarg, "%s", tmp );
+                tree_cache_dir = strdup ( tmp );
+                break;
+            case 'M':
+                sscanf ( optarg, "%f", &recent_trees_mb );
+                break;
+            case 'G':
+                sscanf ( optarg, "%f", &recent_trees_grid );
+                break;
+            case 'P':
+                prediction = true;
+                break;
+            case 'l':
+                sscanf ( optarg, "%f", &latency_target );
+                break;
             case 'f':
                 sscanf ( optarg, "%s", room_file );
                 break;
@@ -118,8 +161,19 @@ int main (int argc, char **argv)
     }
     if (optind < argc) cout << "Abandoned command line parsing at " << argv[optind] << endl;
     
+    // The speculative trees are kept with the recent ones
+    if ( prediction && recent_trees_mb <= 0 ) { recent_trees_mb = 64; }
+    
     Reader *re = new Reader ( material_file, input_socket, threshold_loc, threshold_rot);
+    re->setPrediction ( prediction );
     Solver *s = new Solver ( mindepth, maxdepth, graphics );
+    s->setReciprocalMode ( reciprocal );
+    s->setUpdateThreads ( update_threads );
+    s->setNodeLimits ( node_limit, total_node_limit );
+    s->setBestFirst ( best_first );
+    s->setTreeCache ( tree_cache_dir );
+    s->setRecentTrees ( (size_t)( recent_trees_mb * 1024 * 1024 ), recent_trees_grid );
+    s->setLatencyTarget ( latency_target );
     
     s->attachReader (re);
     re->attachSolver (s);
@@ -127,32 +181,35 @@ int main (int argc, char **argv)
     re->start ();
     COUT << "Reader object started. \n";
     
-    VisualizationWriter *vw;
+    VisualizationWriter *vw = 0;
     if (virchor_addr)
     {
         vw = new VisualizationWriter(virchor_addr);
         vw->connect();
+        vw->start();
         s->addWriter (vw);
     }
     
-    AuralizationWriter *mw;
+    AuralizationWriter *mw = 0;
     if (auralization_addr)
     {
         mw = new AuralizationWriter(auralization_addr);
         mw->connect();
+        mw->start();
         s->addWriter (mw);
     }
     
-    PrintWriter *pw;
+    PrintWriter *pw = 0;
     if (print_addr)
     {
         pw = new PrintWriter(print_addr);
+        pw->start();
         s->addWriter (pw);
     }
     
     while (!re->geometryInitialized ())
     {
-        usleep ( 2000 ); // for mac, else calculation never starts...
+        s->waitForUpdate ();
     }
     COUT << "Got some geometry! \n";
     
@@ -162,13 +219,16 @@ int main (int argc, char **argv)
     while (1)
     {
         s->update ();
-        usleep ( 2000 );
+        s->waitForUpdate ();
     }
     
     delete re;
     delete s;
-    delete mw;
-    delete vw;
+    
+    // The output threads call the writers until stopped
+    if (mw) { mw->stop(); delete mw; }
+    if (vw) { vw->stop(); delete vw; }
+    if (pw) { pw->stop(); delete pw; }
     
     return 0;
 }
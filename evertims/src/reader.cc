@@ -35,7 +35,9 @@
 #include <iostream>
 #include <map>
 #include <cstring>
+#include <math.h>
 #include <pthread.h>
+#include <sys/time.h>
 
 #include "reader.h"
 #include "solver.h"
@@ -44,6 +46,12 @@
 #define SCALER 1.f
 #define MAX_VERTICES 1024
 
+// Gains of the source tracking filter, and the longest gap between messages
+// (seconds) over which the velocity is kept
+#define TRACK_ALPHA 0.5f
+#define TRACK_BETA 0.2f
+#define TRACK_MAX_GAP 0.5
+
 using namespace std;
 
 pthread_t update_thread;
@@ -51,7 +59,9 @@ pthread_t update_thread;
 Reader::Reader (const char* material_filename, int input_port, float threshold_loc, float threshold_rot):
 m_input_port (input_port),
 m_threshold_loc ( threshold_loc * threshold_loc ),  // Comparison is to the square of the distance
-m_threshold_rot ( threshold_rot )
+m_threshold_rot ( threshold_rot ),
+m_prediction ( false ),
+m_geometry_initialized ( false )
 {
     m_materials.readFile(material_filename);
 }
@@ -242,22 +252,20 @@ void Reader::parseListener ( std::string& msg )
     parsePosition(msg, id, pos, ori);
     //  pos[0] = 1.64*SCALER;  pos[1] = 8.27*SCALER;  pos[2] = 2.20*SCALER;
     
-    std::map<std::string, EL::Listener>::iterator l = m_listeners.find(id);
+    std::map<std::string, int>::iterator h = m_listener_handles.find(id);
     
     // Do we know the listener already
-    if ( l != m_listeners.end() )
+    if ( h != m_listener_handles.end() )
     {
         // Yes, we do. So let us check if it moved enough
-        EL::Listener& listener = l->second;
+        EL::Listener& listener = m_listeners[h->second];
         if ( ( pos - listener.getPosition() ).length() > m_threshold_loc )
         {
-            // OK, it did, and we have to update all the solution nodes of this source
+            // OK, it did, and we have to update all the solution nodes of this listener
             listener.setPosition ( pos );
             listener.setOrientation( ori );
             
-            for (std::map<std::string, EL::Source>::iterator s = m_sources.begin();
-                 s != m_sources.end(); s++)
-                m_solver->markListenerMovementMajor ( s->second, listener );
+            m_solver->markListenerMovementMajor ( h->second, pos, ori );
         }
         
         // It did not move enough to resimulate propagation, but did it rotate so that we must update the auralization client?
@@ -266,9 +274,7 @@ void Reader::parseListener ( std::string& msg )
             // OK it did and we just have to notify the auralization client (no solution update required)
             listener.setOrientation( ori );
             
-            for (std::map<std::string, EL::Source>::iterator s = m_sources.begin();
-                 s != m_sources.end(); s++)
-                m_solver->markListenerMovementMinor ( s->second, listener );
+            m_solver->markListenerMovementMinor ( h->second, ori );
         }
     }
     
@@ -281,16 +287,59 @@ void Reader::parseListener ( std::string& msg )
         listener.setOrientation( ori );
         listener.setName ( id );
         
-        m_listeners[id] = listener;
+        int handle = m_listeners.size();
+        m_listener_handles[id] = handle;
+        m_listeners.push_back ( listener );
         
         COUT << "New Listener generated!" << "\n";
         
-        for (std::map<std::string, EL::Source>::iterator s = m_sources.begin();
-             s != m_sources.end(); s++)
-        {
-            m_solver->createNewSolutionNode ( s->second, listener );
-        }
+        m_solver->addListener ( handle, listener );
+        
+        std::map<std::string, float>::iterator p = m_priorities.find(id);
+        if ( p != m_priorities.end() ) { m_solver->setListenerPriority ( handle, p->second ); }
+    }
+}
+
+void Reader::trackSource ( int handle, const EL::Vector3& pos )
+{
+    timeval tv;
+    gettimeofday ( &tv, 0 );
+    double now = tv.tv_sec + tv.tv_usec * 1e-6;
+    
+    if( handle >= (int)m_source_tracks.size () ){ m_source_tracks.resize ( handle + 1, SourceTrack () ); }
+    
+    SourceTrack& track = m_source_tracks[handle];
+    if( now - track.m_time > TRACK_MAX_GAP )
+    {
+        track.m_position = pos;
+        track.m_velocity = EL::Vector3 ( 0, 0, 0 );
+        track.m_time = now;
+        track.m_period = 0;
+        return;
     }
+    
+    float dt = now - track.m_time;
+    if( dt <= 0.f ){ return; }
+    
+    EL::Vector3 expected = track.m_position + dt * track.m_velocity;
+    EL::Vector3 residual = pos - expected;
+    track.m_position = expected + TRACK_ALPHA * residual;
+    track.m_velocity += ( TRACK_BETA / dt ) * residual;
+    track.m_period = track.m_period > 0 ? track.m_period + TRACK_ALPHA * ( dt - track.m_period ) : dt;
+    track.m_time = now;
+}
+
+bool Reader::predictSource ( int handle, EL::Vector3& predicted )
+{
+    if( handle >= (int)m_source_tracks.size () || m_source_tracks[handle].m_period <= 0 ){ return false; }
+    
+    // The next major movement is the first message past the threshold
+    const SourceTrack& track = m_source_tracks[handle];
+    float step = track.m_velocity.length () * track.m_period;
+    if( step <= 0.f ){ return false; }
+    int messages = (int)ceilf ( m_threshold_loc / step );
+    predicted = track.m_position + ( messages * track.m_period ) * track.m_velocity;
+    return true;
 }
 
 void Reader::parseSource ( std::string& msg )
@@ -302,36 +351,38 @@ void Reader::parseSource ( std::string& msg )
     parsePosition(msg, id, pos, ori);
     //  pos[0] = 0.0*SCALER;  pos[1] = -1.0*SCALER;  pos[2] = 1.50*SCALER;
     
-    std::map<std::string, EL::Listener>::iterator l = m_listeners.find(id);
-    std::map<std::string, EL::Source>::iterator s = m_sources.find(id);
+    std::map<std::string, int>::iterator h = m_source_handles.find(id);
     
     // Do we know the source already
-    if ( s != m_sources.end() )
+    if ( h != m_source_handles.end() )
     {
+        EL::Source& source = m_sources[h->second];
+        
+        if ( m_prediction ) { trackSource ( h->second, pos ); }
+        
         // Yes, we do. So let us check if the source really moved enough
-        if ( ( pos - s->second.getPosition() ).length() > m_threshold_loc )
+        if ( ( pos - source.getPosition() ).length() > m_threshold_loc )
         {
             // OK, it did, and we have to update all the solution nodes of this source
-            s->second.setPosition ( pos );
+            source.setPosition ( pos );
+            
+            m_solver->markSourceMovementMajor ( h->second, pos );
             
-            for (std::map<std::string, EL::Listener>::iterator l = m_listeners.begin();
-                 l != m_listeners.end(); l++)
+            // And the solver may get the tree of the next one ready
+            EL::Vector3 predicted;
+            if ( m_prediction && predictSource ( h->second, predicted ) )
             {
-                m_solver->markSourceMovementMajor ( s->second, l->second );
+                m_solver->predictSourceMovement ( h->second, predicted );
             }
         }
 
         // It did not move enough to resimulate propagation, but did it rotate so that we must update the auralization client?
-        if ( ( ori.toEuler() - s->second.getOrientation().toEuler() ).length() > m_threshold_rot )
+        if ( ( ori.toEuler() - source.getOrientation().toEuler() ).length() > m_threshold_rot )
         {
             // OK it did and we just have to notify the auralization client (no solution update required)
-            s->second.setOrientation( ori );
+            source.setOrientation( ori );
             
-            for (std::map<std::string, EL::Listener>::iterator l = m_listeners.begin();
-                 l != m_listeners.end(); l++)
-            {
-                m_solver->markSourceMovementMinor ( s->second, l->second );
-            }
+            m_solver->markSourceMovementMinor ( h->second, ori );
         }
     }
     
@@ -344,32 +395,51 @@ void Reader::parseSource ( std::string& msg )
         source.setOrientation ( ori );
         source.setName ( id );
         
-        m_sources[id] = source;
+        int handle = m_sources.size();
+        m_source_handles[id] = handle;
+        m_sources.push_back ( source );
+        
+        if ( m_prediction ) { trackSource ( handle, pos ); }
         
         COUT << "New source generated!" << "\n";
         
-        for (std::map<std::string, EL::Listener>::iterator l = m_listeners.begin();
-             l != m_listeners.end(); l++)
-        {
-            m_solver->createNewSolutionNode ( source, l->second );
-        }
+        m_solver->addSource ( handle, source );
+        
+        std::map<std::string, float>::iterator p = m_priorities.find(id);
+        if ( p != m_priorities.end() ) { m_solver->setSourcePriority ( handle, p->second ); }
     }
 }
 
+void Reader::parsePriority ( std::string& msg )
+{
+    char idBuf[512];
+    float priority;
+    
+    if ( sscanf ( strchr ( msg.c_str(), ' ' ) + 1, "%511s %f", idBuf, &priority ) != 2 ) { return; }
+    
+    std::string id ( idBuf );
+    m_priorities[id] = priority;
+    COUT << "Priority of " << id << " set to " << priority << "\n";
+    
+    std::map<std::string, int>::iterator h = m_source_handles.find(id);
+    if ( h != m_source_handles.end() ) { m_solver->setSourcePriority ( h->second, priority ); }
+    
+    h = m_listener_handles.find(id);
+    if ( h != m_listener_handles.end() ) { m_solver->setListenerPriority ( h->second, priority ); }
+}
+
 void Reader::printSourcesAndListeners()
 {
     COUT << "Sources: ";
-    for (std::map<std::string, EL::Source>::iterator s = m_sources.begin();
-         s != m_sources.end(); s++)
+    for (int s = 0; s < (int)m_sources.size(); s++)
     {
-        COUT << s->second.getName () << " ";
+        COUT << m_sources[s].getName () << " ";
     }
     
     COUT << "\n" << "Listener: ";
-    for (std::map<std::string, EL::Listener>::iterator l = m_listeners.begin();
-         l != m_listeners.end(); l++)
+    for (int l = 0; l < (int)m_listeners.size(); l++)
     {
-        COUT << l->second.getName () << " ";
+        COUT << m_listeners[l].getName () << " ";
     }
     COUT << "\n";
 }
@@ -416,6 +486,10 @@ void *update_loop (void *obj)
             COUT << "Listener ";
             re->parseListener(message);
         } 
+        else if (message.find("/priority ")==0)
+        {
+            re->parsePriority(message);
+        }
         else if (message.find("/facefinished")==0)
         {
             COUT << "Geometry modficiations done. Signaling the solver to restart." << "\n";
@@ -431,7 +505,7 @@ void Reader::signalSolver ()
     
     if (m_solver)
     {
-        m_solver->markGeometryChanged();
+        m_solver->markGeometryChanged ( m_elements );
     }
 }
 
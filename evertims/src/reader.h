@@ -35,6 +35,7 @@
 #ifndef _READER_H
 #define _READER_H
 
+#include <atomic>
 #include <vector>
 #include <map>
 #include <set>
@@ -75,11 +76,32 @@ public:
     void parseSource ( std::string& msg );
     void parseListener ( std::string& msg );
     
+    // "/priority name value": weight of the source or listener of that name
+    // when the solver ranks its jobs, kept for objects not seen yet
+    void parsePriority ( std::string& msg );
+    
+    // Track the sources at constant velocity and tell the solver where
+    // their next major movements are expected
+    EL_FORCE_INLINE void setPrediction (bool enabled) { m_prediction = enabled; }
+    
     void printSourcesAndListeners();
     
     
 private:
     
+    // Alpha-beta filtered position and velocity of a source, and the
+    // smoothed period of its messages
+    struct SourceTrack
+    {
+        EL::Vector3 m_position;
+        EL::Vector3 m_velocity;
+        double      m_time;
+        double      m_period;
+    };
+    
+    void trackSource ( int handle, const EL::Vector3& pos );
+    bool predictSource ( int handle, EL::Vector3& predicted );
+    
     int m_input_port;
     float m_threshold_loc;
     float m_threshold_rot;
@@ -88,10 +110,18 @@ private:
     std::map<std::string, EL::Room::Element> emap;
     
     std::vector<EL::Room::Element> m_elements;
-    std::map<std::string, EL::Listener> m_listeners;
-    std::map<std::string, EL::Source> m_sources;
-    
-    bool m_geometry_initialized;
+    // The listeners and sources by the handles the solver knows them by,
+    // given in the order they are first seen
+    std::vector<EL::Listener> m_listeners;
+    std::vector<EL::Source> m_sources;
+    std::map<std::string, int> m_listener_handles;
+    std::map<std::string, int> m_source_handles;
+    std::map<std::string, float> m_priorities;
+    
+    bool m_prediction;
+    std::vector<SourceTrack> m_source_tracks;
+    
+    std::atomic<bool> m_geometry_initialized;
     
     Solver *m_solver;
 };
@@ -158,7 +158,7 @@ ReverbEstimator::ReverbEstimator (double samplingFrequency, EL::PathSolution *so
     
     for (int i = 0; i < solution->numPaths(); i++)
     {
-        const EL::PathSolution::Path& path = solution->getPath(i);
+        const EL::PathSolution::Path path = solution->getPath(i);
         
         // get path total duration
         len = solution->getLength( path );
@@ -34,6 +34,10 @@
 
 #include <pthread.h>
 #include <sys/errno.h>
+#include <sys/time.h>
+#include <math.h>
+#include <algorithm>
+#include <set>
 #include <vector>
 #include <iostream>
 #include <time.h>
@@ -54,44 +58,55 @@
 
 using namespace std;
 
-bool calculate_signal;
+std::string solutionID( const EL::Source& source, const EL::Listener& listener );
+
+static double getTime ()
+{
+    timeval tv;
+    gettimeofday ( &tv, 0 );
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
 
 Solver::Solver (int mindepth, int maxdepth, bool graphics) :
-m_next_solution_flag ( false ),
 m_request_for_stop ( false ),
-m_start_new ( true ),
+m_reciprocal_mode ( false ),
+m_reciprocal ( false ),
+m_update_threads ( 1 ),
+m_update_pool ( 0 ),
+m_node_limit ( 0 ),
+m_total_node_limit ( 0 ),
+m_truncated_trees ( 0 ),
+m_best_first ( false ),
+m_tree_cache ( 0 ),
+m_recent_trees_room ( -1 ),
+m_latency_target ( 0 ),
+m_order_growth ( 3 ),
+m_last_update_time ( -1 ),
+m_tuned_room ( -1 ),
+m_tuned_room_hash ( 0 ),
 m_graphics ( graphics ),
 m_current_room ( 0 ),
 isLoadingNewRoom ( true ),
-m_lastMappedSolutionNode ( -1 ),
-m_lastAvailableSolutionNode ( -1 ),
-m_newSolutionNodesAvailable ( false ),
-m_next_solution ( 0 ),
+m_room ( new EL::RoomSnapshot ),
+m_next_job ( 0 ),
+m_calculate_signal ( false ),
+m_update_signal ( false ),
+m_update_sleeping ( false ),
+m_commands ( COMMAND_QUEUE_SIZE ),
+m_drains ( 0 ),
+m_dropped_updates ( 0 ),
 m_reader ( 0 ),
 m_min_depth ( mindepth ),
 m_max_depth ( maxdepth )
 {
-    /*
-     for (int idx=0 ; idx < MAX_NUM_SOLUTIONS ; idx++)
-     {
-     m_solutionNodes[idx].m_listener_status_major = UPDATED;
-     m_solutionNodes[idx].m_geom_or_source_status = CHANGED;
-     m_solutionNodes[idx].m_to_send = false;
-     m_solutionNodes[idx].m_source = EL::Source();
-     m_solutionNodes[idx].m_listener = EL::Listener();
-     m_solutionNodes[idx].m_new_source_position = EL::Vector3 (-1000, 2000, 3434);
-     m_solutionNodes[idx].m_new_listener_position = EL::Vector3 (-1000, 2000, 3434);
-     m_solutionNodes[idx].m_solution = 0;
-     m_solutionNodes[idx].m_writers.clear();
-     }
-     */
+    m_room->addReference ();
     
-    EL::setStopSignalValue(false);
+    pthread_mutex_init (&m_signal_mutex, NULL);
+    pthread_cond_init (&m_update_cond, NULL);
+    pthread_cond_init (&m_calculate_cond, NULL);
+    pthread_cond_init (&m_drain_cond, NULL);
     
-    pthread_mutex_init (&next_solution_mutex, NULL);
-    
-    // Start a new thread with m_next_solution.update ()
-    calculate_signal = false;
+    // Start a new thread with m_next_job->run ()
     int error = pthread_create (&path_solver_thread, NULL,
                                 path_solver_function, (void *)this);
     
@@ -142,14 +157,592 @@ m_max_depth ( maxdepth )
      */
 }
 
-Solver::~Solver () {}
+Solver::~Solver ()
+{
+    if( m_next_job )
+    {
+        m_next_job->cancel ();
+        m_next_job->wait ();
+        finishCalculation ();
+    }
+    
+    Command command;
+    while( m_commands.pop ( command ) ){ delete command.m_elements; delete command.m_name; }
+    for( int i = 0; i < (int)m_solutionNodes.size(); i++ ){ delete m_solutionNodes[i]; }
+    m_room->removeReference ();
+    delete m_update_pool;
+    delete m_tree_cache;
+}
+
+Solver::CommandQueue::CommandQueue ( int capacity ) :
+m_cells ( new Cell[capacity] ),
+m_mask ( capacity - 1 ),
+m_tail ( 0 ),
+m_head ( 0 )
+{
+    for( int i = 0; i < capacity; i++ ){ m_cells[i].m_sequence.store ( i, std::memory_order_relaxed ); }
+}
+
+Solver::CommandQueue::~CommandQueue ()
+{
+    delete [] m_cells;
+}
+
+bool Solver::CommandQueue::push ( const Command& command )
+{
+    // Claim the tail cell once its previous command has been consumed
+    size_t position = m_tail.load ( std::memory_order_relaxed );
+    Cell *cell;
+    while( 1 )
+    {
+        cell = &m_cells[position & m_mask];
+        size_t sequence = cell->m_sequence.load ( std::memory_order_acquire );
+        long difference = (long)sequence - (long)position;
+        if( difference == 0 )
+        {
+            if( m_tail.compare_exchange_weak ( position, position + 1, std::memory_order_relaxed ) ){ break; }
+        }
+        else if( difference < 0 ){ return false; }
+        else{ position = m_tail.load ( std::memory_order_relaxed ); }
+    }
+    cell->m_command = command;
+    cell->m_sequence.store ( position + 1, std::memory_order_release );
+    return true;
+}
+
+bool Solver::CommandQueue::pop ( Command& command )
+{
+    Cell *cell = &m_cells[m_head & m_mask];
+    if( cell->m_sequence.load ( std::memory_order_acquire ) != m_head + 1 ){ return false; }
+    
+    command = cell->m_command;
+    cell->m_command.m_elements = 0;
+    cell->m_command.m_name = 0;
+    cell->m_sequence.store ( m_head + m_mask + 1, std::memory_order_release );
+    m_head++;
+    return true;
+}
+
+void Solver::postCommand ( Command& command, enum Command::Type type, int handle )
+{
+    command.m_type = type;
+    command.m_handle = handle;
+    command.m_time = getTime ();
+    
+    // A full queue holds the reader until the main loop has drained it,
+    // only then is the lock taken
+    unsigned drains = m_drains.load ();
+    while( !m_commands.push ( command ) )
+    {
+        signalUpdate ();
+        pthread_mutex_lock (&m_signal_mutex);
+        while( m_drains.load () == drains ){ pthread_cond_wait (&m_drain_cond, &m_signal_mutex); }
+        drains = m_drains.load ();
+        pthread_mutex_unlock (&m_signal_mutex);
+    }
+    signalUpdate ();
+}
+
+// The tracker updates, only the latest of each kind for an object counts.
+// Geometry, new objects and priorities are all applied in order
+static bool isCoalesced( enum Solver::Command::Type type )
+{
+    switch( type )
+    {
+        case Solver::Command::SOURCE_MAJOR:
+        case Solver::Command::SOURCE_MINOR:
+        case Solver::Command::LISTENER_MAJOR:
+        case Solver::Command::LISTENER_MINOR:
+        case Solver::Command::PREDICTION:
+            return true;
+        default:
+            return false;
+    }
+}
+
+void Solver::applyCommands ()
+{
+    std::vector<Command>& commands = m_pending_commands;
+    Command command;
+    while( m_commands.pop ( command ) ){ commands.push_back ( command ); }
+    
+    // Latest wins: a tracker update is dropped when a later one of the same
+    // kind for the same object is pending, which inherits its receive time
+    std::vector<bool>& dropped = m_dropped_commands;
+    dropped.assign ( commands.size (), false );
+    int drops = 0;
+    for( int i = (int)commands.size () - 1; i >= 0; i-- )
+    {
+        if( !isCoalesced ( commands[i].m_type ) ){ continue; }
+        
+        size_t key = commands[i].m_handle * Command::NUM_TYPES + commands[i].m_type;
+        if( key >= m_latest_commands.size () ){ m_latest_commands.resize ( key + 1, -1 ); }
+        int& latest = m_latest_commands[key];
+        if( latest < 0 ){ latest = i; continue; }
+        
+        Command& kept = commands[latest];
+        kept.m_time = min ( kept.m_time, commands[i].m_time );
+        dropped[i] = true;
+        drops++;
+    }
+    if( drops > 0 )
+    {
+        m_dropped_updates += drops;
+        COUT << "Dropped " << drops << " superseded tracker updates ( " << m_dropped_updates << " in total )" << "\n";
+    }
+    
+    for( int i = 0; i < (int)commands.size (); i++ )
+    {
+        if( isCoalesced ( commands[i].m_type ) )
+        {
+            m_latest_commands[commands[i].m_handle * Command::NUM_TYPES + commands[i].m_type] = -1;
+        }
+        if( dropped[i] ){ continue; }
+        
+        const Command& command = commands[i];
+        int handle = command.m_handle;
+        switch( command.m_type )
+        {
+            case Command::GEOMETRY:
+                applyGeometryChange ( *command.m_elements, command.m_time );
+                delete command.m_elements;
+                break;
+            case Command::NEW_SOURCE:
+                applyNewSource ( handle, command );
+                delete command.m_name;
+                break;
+            case Command::NEW_LISTENER:
+                applyNewListener ( handle, command );
+                delete command.m_name;
+                break;
+            case Command::SOURCE_MAJOR:
+                m_sources[handle].setPosition ( command.m_position );
+                for( int l = 0; l < (int)m_listeners.size(); l++ )
+                {
+                    if( m_pairs[handle][l] ){ applySourceMovementMajor ( m_pairs[handle][l], command.m_position, command.m_time ); }
+                }
+                break;
+            case Command::SOURCE_MINOR:
+                m_sources[handle].setOrientation ( command.m_orientation );
+                for( int l = 0; l < (int)m_listeners.size(); l++ )
+                {
+                    if( m_pairs[handle][l] ){ applySourceMovementMinor ( m_pairs[handle][l], command.m_orientation ); }
+                }
+                break;
+            case Command::LISTENER_MAJOR:
+                m_listeners[handle].setPosition ( command.m_position );
+                m_listeners[handle].setOrientation ( command.m_orientation );
+                for( int s = 0; s < (int)m_sources.size(); s++ )
+                {
+                    if( m_pairs[s][handle] ){ applyListenerMovementMajor ( m_pairs[s][handle], command.m_position, command.m_orientation, command.m_time ); }
+                }
+                break;
+            case Command::LISTENER_MINOR:
+                m_listeners[handle].setOrientation ( command.m_orientation );
+                for( int s = 0; s < (int)m_sources.size(); s++ )
+                {
+                    if( m_pairs[s][handle] ){ applyListenerMovementMinor ( m_pairs[s][handle], command.m_orientation ); }
+                }
+                break;
+            case Command::PREDICTION:
+                for( int l = 0; l < (int)m_listeners.size(); l++ )
+                {
+                    if( m_pairs[handle][l] ){ applySourceMovementPrediction ( m_pairs[handle][l], command.m_position ); }
+                }
+                break;
+            case Command::SOURCE_PRIORITY:
+                m_source_priorities[handle] = command.m_value;
+                break;
+            case Command::LISTENER_PRIORITY:
+                m_listener_priorities[handle] = command.m_value;
+                break;
+            default:
+                break;
+        }
+    }
+    
+    if( !commands.empty () )
+    {
+        commands.clear ();
+        m_drains++;
+        pthread_mutex_lock (&m_signal_mutex);
+        pthread_cond_broadcast (&m_drain_cond);
+        pthread_mutex_unlock (&m_signal_mutex);
+    }
+}
+
+void Solver::markGeometryChanged ( const std::vector<EL::Room::Element>& elements )
+{
+    Command command;
+    command.m_name = 0;
+    command.m_elements = new std::vector<EL::Room::Element> ( elements );
+    postCommand ( command, Command::GEOMETRY, -1 );
+}
+
+void Solver::addSource ( int source, const EL::Source& object )
+{
+    Command command;
+    command.m_position = object.getPosition ();
+    command.m_orientation = object.getOrientation ();
+    command.m_name = new std::string ( object.getName () );
+    command.m_elements = 0;
+    postCommand ( command, Command::NEW_SOURCE, source );
+}
+
+void Solver::addListener ( int listener, const EL::Listener& object )
+{
+    Command command;
+    command.m_position = object.getPosition ();
+    command.m_orientation = object.getOrientation ();
+    command.m_name = new std::string ( object.getName () );
+    command.m_elements = 0;
+    postCommand ( command, Command::NEW_LISTENER, listener );
+}
+
+void Solver::markSourceMovementMajor ( int source, const EL::Vector3& position )
+{
+    Command command;
+    command.m_position = position;
+    command.m_name = 0;
+    command.m_elements = 0;
+    postCommand ( command, Command::SOURCE_MAJOR, source );
+}
+
+void Solver::markSourceMovementMinor ( int source, const EL::Matrix3& orientation )
+{
+    Command command;
+    command.m_orientation = orientation;
+    command.m_name = 0;
+    command.m_elements = 0;
+    postCommand ( command, Command::SOURCE_MINOR, source );
+}
+
+void Solver::markListenerMovementMajor ( int listener, const EL::Vector3& position, const EL::Matrix3& orientation )
+{
+    Command command;
+    command.m_position = position;
+    command.m_orientation = orientation;
+    command.m_name = 0;
+    command.m_elements = 0;
+    postCommand ( command, Command::LISTENER_MAJOR, listener );
+}
+
+void Solver::markListenerMovementMinor ( int listener, const EL::Matrix3& orientation )
+{
+    Command command;
+    command.m_orientation = orientation;
+    command.m_name = 0;
+    command.m_elements = 0;
+    postCommand ( command, Command::LISTENER_MINOR, listener );
+}
+
+void Solver::predictSourceMovement ( int source, const EL::Vector3& position )
+{
+    Command command;
+    command.m_position = position;
+    command.m_name = 0;
+    command.m_elements = 0;
+    postCommand ( command, Command::PREDICTION, source );
+}
+
+void Solver::setSourcePriority ( int source, float priority )
+{
+    Command command;
+    command.m_value = priority;
+    command.m_name = 0;
+    command.m_elements = 0;
+    postCommand ( command, Command::SOURCE_PRIORITY, source );
+}
+
+void Solver::setListenerPriority ( int listener, float priority )
+{
+    Command command;
+    command.m_value = priority;
+    command.m_name = 0;
+    command.m_elements = 0;
+    postCommand ( command, Command::LISTENER_PRIORITY, listener );
+}
+
+void Solver::signalUpdate ()
+{
+    // Either the main loop is seen sleeping, or it sees the signal
+    // before it sleeps
+    m_update_signal.store ( true );
+    if( m_update_sleeping.load () )
+    {
+        pthread_mutex_lock (&m_signal_mutex);
+        pthread_cond_signal (&m_update_cond);
+        pthread_mutex_unlock (&m_signal_mutex);
+    }
+}
+
+void Solver::waitForUpdate ()
+{
+    if( m_update_signal.exchange ( false ) ){ return; }
+    
+    pthread_mutex_lock (&m_signal_mutex);
+    m_update_sleeping.store ( true );
+    while( !m_update_signal.exchange ( false ) ){ pthread_cond_wait (&m_update_cond, &m_signal_mutex); }
+    m_update_sleeping.store ( false );
+    pthread_mutex_unlock (&m_signal_mutex);
+}
+
+void Solver::signalCalculation ()
+{
+    pthread_mutex_lock (&m_signal_mutex);
+    m_calculate_signal = true;
+    pthread_cond_signal (&m_calculate_cond);
+    pthread_mutex_unlock (&m_signal_mutex);
+}
+
+void Solver::waitForCalculation ()
+{
+    pthread_mutex_lock (&m_signal_mutex);
+    while( !m_calculate_signal ){ pthread_cond_wait (&m_calculate_cond, &m_signal_mutex); }
+    m_calculate_signal = false;
+    pthread_mutex_unlock (&m_signal_mutex);
+}
+
+void Solver::setUpdateThreads ( int threads )
+{
+    m_update_threads = threads;
+    delete m_update_pool;
+    m_update_pool = threads > 1 ? new EL::UpdatePool ( threads ) : 0;
+}
+
+void Solver::setTreeCache ( const char* directory )
+{
+    delete m_tree_cache;
+    m_tree_cache = directory ? new EL::BeamTreeCache ( directory ) : 0;
+}
+
+Solver::SolveJob::SolveJob ( EL::BeamTree *tree, bool progressive, bool reciprocal ) :
+m_tree ( tree ),
+m_progressive ( progressive ),
+m_published_order ( -1 ),
+m_reciprocal ( reciprocal ),
+m_predicted ( false ),
+m_speculative ( false ),
+m_done ( false ),
+m_order ( -1 )
+{
+    m_tree->addReference ();
+    pthread_mutex_init (&m_tree_mutex, NULL);
+    pthread_mutex_init (&m_mutex, NULL);
+    pthread_cond_init (&m_cond, NULL);
+}
+
+Solver::SolveJob::~SolveJob ()
+{
+    pthread_cond_destroy (&m_cond);
+    pthread_mutex_destroy (&m_mutex);
+    pthread_mutex_destroy (&m_tree_mutex);
+    m_tree->removeReference ();
+}
+
+void Solver::SolveJob::run ( Solver *solver )
+{
+    bool done = false;
+    double start = getTime ();
+    while( !done && !m_tree->isCancelled () )
+    {
+        // Solve in slices so that completed orders get published
+        pthread_mutex_lock (&m_tree_mutex);
+        done = m_tree->solve ( SOLVE_TIME_BUDGET );
+        int order = m_tree->getCompletedOrder ();
+        pthread_mutex_unlock (&m_tree_mutex);
+        
+        while( (int)m_order_times.size () <= order ){ m_order_times.push_back ( getTime () - start ); }
+        
+        pthread_mutex_lock (&m_mutex);
+        bool completed = ( order > m_order );
+        m_order = order;
+        pthread_mutex_unlock (&m_mutex);
+        
+        // A completed order may be published at once
+        if( completed && m_progressive ){ solver->signalUpdate (); }
+    }
+    if( done ){ printf ( "Solved!\n" ); }
+    
+    // Written out of the tree lock, the updates may go on meanwhile
+    if( done ){ m_tree->saveToCache (); }
+    
+    pthread_mutex_lock (&m_mutex);
+    m_done = true;
+    pthread_cond_broadcast (&m_cond);
+    pthread_mutex_unlock (&m_mutex);
+    
+    solver->signalUpdate ();
+}
+
+bool Solver::SolveJob::isDone ()
+{
+    pthread_mutex_lock (&m_mutex);
+    bool done = m_done;
+    pthread_mutex_unlock (&m_mutex);
+    return done;
+}
+
+void Solver::SolveJob::wait ()
+{
+    pthread_mutex_lock (&m_mutex);
+    while( !m_done ){ pthread_cond_wait (&m_cond, &m_mutex); }
+    pthread_mutex_unlock (&m_mutex);
+}
+
+int Solver::SolveJob::getCompletedOrder ()
+{
+    pthread_mutex_lock (&m_mutex);
+    int order = m_order;
+    pthread_mutex_unlock (&m_mutex);
+    return order;
+}
+
+Solver::RecentTrees::RecentTrees () :
+m_hits ( 0 ),
+m_speculative_hits ( 0 ),
+m_speculative_misses ( 0 ),
+m_bytes ( 0 ),
+m_max_bytes ( 0 ),
+m_grid_size ( 0.01f )
+{
+}
+
+Solver::RecentTrees::~RecentTrees ()
+{
+    clear ();
+}
+
+bool Solver::RecentTrees::Key::operator< ( const Key& other ) const
+{
+    for( int i = 0; i < 3; i++ )
+    {
+        if( m_cell[i] != other.m_cell[i] ){ return m_cell[i] < other.m_cell[i]; }
+    }
+    return m_reciprocal < other.m_reciprocal;
+}
+
+void Solver::RecentTrees::setLimits ( size_t maxBytes, float gridSize )
+{
+    clear ();
+    m_max_bytes = maxBytes;
+    if( gridSize > 0.f ){ m_grid_size = gridSize; }
+}
+
+Solver::RecentTrees::Key Solver::RecentTrees::getKey ( const EL::Vector3& root, bool reciprocal ) const
+{
+    Key key;
+    for( int i = 0; i < 3; i++ ){ key.m_cell[i] = (int)floorf ( root[i] / m_grid_size + .5f ); }
+    key.m_reciprocal = reciprocal;
+    return key;
+}
+
+void Solver::RecentTrees::remove ( std::list<Entry>::iterator entry )
+{
+    if( entry->m_speculative ){ m_speculative_misses++; }
+    m_bytes -= entry->m_bytes;
+    entry->m_tree->removeReference ();
+    m_index.erase ( entry->m_key );
+    m_entries.erase ( entry );
+}
+
+void Solver::RecentTrees::insert ( EL::BeamTree *tree, bool reciprocal, bool speculative )
+{
+    size_t bytes = tree->getMemorySize ();
+    if( bytes > m_max_bytes || !tree->isComplete () )
+    {
+        if( speculative ){ m_speculative_misses++; }
+        return;
+    }
+    
+    // The newest tree of a cell replaces the older one
+    Key key = getKey ( tree->getSource (), reciprocal );
+    std::map<Key, std::list<Entry>::iterator>::iterator it = m_index.find ( key );
+    if( it != m_index.end () )
+    {
+        if( it->second->m_tree == tree )
+        {
+            m_entries.splice ( m_entries.begin (), m_entries, it->second );
+            return;
+        }
+        remove ( it->second );
+    }
+    
+    Entry entry;
+    entry.m_key = key;
+    entry.m_tree = tree;
+    entry.m_bytes = bytes;
+    entry.m_speculative = speculative;
+    tree->addReference ();
+    m_entries.push_front ( entry );
+    m_index[key] = m_entries.begin ();
+    m_bytes += bytes;
+    
+    while( m_bytes > m_max_bytes ){ remove ( --m_entries.end () ); }
+}
+
+std::list<Solver::RecentTrees::Entry>::iterator Solver::RecentTrees::lookup ( const EL::Room *room, const EL::Vector3& root, bool reciprocal )
+{
+    // The closest tree within a grid step is in one of the neighbour cells
+    Key key = getKey ( root, reciprocal );
+    std::list<Entry>::iterator best = m_entries.end ();
+    float bestDistance = m_grid_size;
+    for( int i = 0; i < 27; i++ )
+    {
+        Key cell = key;
+        cell.m_cell[0] += i % 3 - 1;
+        cell.m_cell[1] += ( i / 3 ) % 3 - 1;
+        cell.m_cell[2] += i / 9 - 1;
+        
+        std::map<Key, std::list<Entry>::iterator>::iterator it = m_index.find ( cell );
+        if( it == m_index.end () || &it->second->m_tree->getRoom () != room ){ continue; }
+        
+        float distance = ( it->second->m_tree->getSource () - root ).length ();
+        if( distance <= bestDistance )
+        {
+            best = it->second;
+            bestDistance = distance;
+        }
+    }
+    
+    return best;
+}
+
+EL::BeamTree *Solver::RecentTrees::find ( const EL::Room *room, const EL::Vector3& root, bool reciprocal )
+{
+    std::list<Entry>::iterator entry = lookup ( room, root, reciprocal );
+    if( entry == m_entries.end () ){ return 0; }
+    
+    m_hits++;
+    if( entry->m_speculative )
+    {
+        entry->m_speculative = false;
+        m_speculative_hits++;
+    }
+    m_entries.splice ( m_entries.begin (), m_entries, entry );
+    return entry->m_tree;
+}
+
+bool Solver::RecentTrees::contains ( const EL::Room *room, const EL::Vector3& root, bool reciprocal )
+{
+    return lookup ( room, root, reciprocal ) != m_entries.end ();
+}
+
+void Solver::RecentTrees::clear ()
+{
+    while( !m_entries.empty () ){ remove ( m_entries.begin () ); }
+}
 
 void Solver::readRoomDescription( const char* file_name, MaterialFile& materials )
 {
-    m_room[0].import(file_name, materials);
-    m_room[1] = m_room[0];
+    EL::RoomSnapshot *room = new EL::RoomSnapshot;
+    room->getRoom ().import(file_name, materials);
+    room->addReference ();
+    m_room->removeReference ();
+    m_room = room;
+    m_current_room++;
     
-    m_reader->initializeMembers(m_room[0]);
+    m_reader->initializeMembers(m_room->getRoom ());
     
     return;
 }
@@ -166,42 +759,81 @@ std::string solutionID( const EL::Source& source, const EL::Listener& listener )
     return id;
 }
 
-void Solver::createNewSolutionNode( const EL::Source& source, const EL::Listener& listener )
+void Solver::applyNewSource( int source, const Command& command )
 {
-    int idx = m_lastAvailableSolutionNode + 1;
+    if( source >= (int)m_sources.size() )
+    {
+        m_sources.resize ( source + 1 );
+        m_source_priorities.resize ( source + 1, 1.f );
+        m_pairs.resize ( source + 1, t_solutionNodeList ( m_listeners.size(), 0 ) );
+    }
+    m_sources[source].setPosition ( command.m_position );
+    m_sources[source].setOrientation ( command.m_orientation );
+    m_sources[source].setName ( *command.m_name );
     
-    if( idx >= MAX_NUM_SOLUTIONS )
+    for( int l = 0; l < (int)m_listeners.size(); l++ ){ createNewSolutionNode ( source, l, command.m_time ); }
+    updateRootSide ();
+}
+
+void Solver::applyNewListener( int listener, const Command& command )
+{
+    if( listener >= (int)m_listeners.size() )
     {
-        cerr << "Too many solution nodes!!! (go and increase the MAX_NUM_SOLUTIONS constant or find the bug causing me to be here." << endl;
-        return;
+        m_listeners.resize ( listener + 1 );
+        m_listener_priorities.resize ( listener + 1, 1.f );
+        for( int s = 0; s < (int)m_pairs.size(); s++ ){ m_pairs[s].resize ( listener + 1, 0 ); }
     }
-    m_solutionNodes[idx].m_listener_status_major = UPDATED;
-    m_solutionNodes[idx].m_geom_or_source_status = CHANGED;
-    m_solutionNodes[idx].m_to_send = false;
-    for (int i=0;i<2;i++){ m_solutionNodes[idx].m_source[i] = source; }
-    for (int i=0;i<2;i++){ m_solutionNodes[idx].m_listener[i] = listener; }
-    m_solutionNodes[idx].m_new_source_position = source.getPosition ();
-    m_solutionNodes[idx].m_new_source_orientation = source.getOrientation ();
-    m_solutionNodes[idx].m_new_listener_position = listener.getPosition ();
-    m_solutionNodes[idx].m_new_listener_orientation = listener.getOrientation ();
-    m_solutionNodes[idx].m_solution = 0;
-    m_solutionNodes[idx].m_current = 0;
-    
-    std::string ID = solutionID ( source, listener );
+    m_listeners[listener].setPosition ( command.m_position );
+    m_listeners[listener].setOrientation ( command.m_orientation );
+    m_listeners[listener].setName ( *command.m_name );
+    
+    for( int s = 0; s < (int)m_sources.size(); s++ ){ createNewSolutionNode ( s, listener, command.m_time ); }
+    updateRootSide ();
+}
+
+void Solver::createNewSolutionNode( int source, int listener, double time )
+{
+    std::string ID = solutionID ( m_sources[source], m_listeners[listener] );
     const char *ID_cptr = ID.c_str();
     
+    // Only the pairs some writer is interested in are solved
+    std::vector<Writer *> writers;
     for( int i = 0; i < m_writers.size(); i++ )
     {
-        if( m_writers[i]->match( ID_cptr ) )
-        {
-            m_solutionNodes[idx].m_writers.push_back( m_writers[i] );
-        }
+        if( m_writers[i]->match( ID_cptr ) ){ writers.push_back( m_writers[i] ); }
     }
+    if( writers.empty () ){ return; }
+    
+    struct SolutionNode *node = new SolutionNode;
+    node->m_listener_status_major = UPDATED;
+    node->m_listener_status_minor = UPDATED;
+    node->m_source_status_minor = UPDATED;
+    node->m_geom_or_source_status = CHANGED;
+    node->m_request_for_stop = false;
+    node->m_to_send = false;
+    for (int i=0;i<2;i++){ node->m_source[i] = m_sources[source]; }
+    for (int i=0;i<2;i++){ node->m_listener[i] = m_listeners[listener]; }
+    node->m_new_source_position = m_sources[source].getPosition ();
+    node->m_new_source_orientation = m_sources[source].getOrientation ();
+    node->m_new_listener_position = m_listeners[listener].getPosition ();
+    node->m_new_listener_orientation = m_listeners[listener].getOrientation ();
+    node->m_solution = 0;
+    node->m_current = 0;
+    node->m_writers = writers;
+    node->m_source_handle = source;
+    node->m_listener_handle = listener;
+    node->m_geometry_changed = true;
+    node->m_audibility = 0;
+    node->m_prediction_status = UPDATED;
+    node->m_predicted_tree = 0;
+    node->m_move_time = time;
+    node->m_latency = -1;
+    node->m_update_time = -1;
     
-    COUT << "New solution node " << idx << " for " << solutionID( source, listener ) << " generated." << "\n";
+    m_solutionNodes.push_back ( node );
+    m_pairs[source][listener] = node;
     
-    m_lastAvailableSolutionNode = idx;
-    m_newSolutionNodesAvailable = true;
+    COUT << "New solution node " << m_solutionNodes.size() - 1 << " for " << ID << " generated." << "\n";
 }
 
 std::string solutionID( EL::PathSolution* solution )
@@ -209,132 +841,543 @@ std::string solutionID( EL::PathSolution* solution )
     return solutionID( solution->getSource(), solution->getListener() );
 }
 
-void Solver::mapAvailableSolutionNodes ()
+void Solver::updateRootSide ()
 {
-    int i = 0;
+    if( !m_reciprocal_mode ){ return; }
+    
+    std::set<int> sources, listeners;
+    for( t_solutionNodeIterator it = m_solutionNodes.begin(); it != m_solutionNodes.end() ; it++ )
+    {
+        sources.insert ( (*it)->m_source_handle );
+        listeners.insert ( (*it)->m_listener_handle );
+    }
     
-    m_newSolutionNodesAvailable = false;
+    // The side is the same for all the pairs of the room, changing it
+    // needs new trees for all of them
+    bool reciprocal = ( listeners.size () < sources.size () );
+    if( reciprocal == m_reciprocal ){ return; }
     
-    for( i = m_lastMappedSolutionNode + 1 ; i <= m_lastAvailableSolutionNode; i++ )
+    COUT << "Rooting the beam trees at the " << ( reciprocal ? "listeners" : "sources" ) << "\n";
+    m_reciprocal = reciprocal;
+    
+    for( t_solutionNodeIterator it = m_solutionNodes.begin(); it != m_solutionNodes.end() ; it++ )
     {
-        std::string id = solutionID ( m_solutionNodes[i].m_source[0], m_solutionNodes[i].m_listener[0] );
-        
-        if (m_solutionNodes[i].m_writers.size () > 0) { m_solutionNodeMap[id] = &(m_solutionNodes[i]); }
+        (*it)->m_geom_or_source_status = CHANGED;
+        (*it)->m_geometry_changed = true;
     }
-    m_lastMappedSolutionNode = i - 1;
+    m_request_for_stop = true;
+}
+
+const EL::Vector3& Solver::getRootPosition( struct SolutionNode *node )
+{
+    return m_reciprocal ? node->m_new_listener_position : node->m_new_source_position;
 }
 
-void Solver::markSourceMovementMajor( const EL::Source& source, const EL::Listener& listener )
+const EL::Vector3& Solver::getTargetPosition( struct SolutionNode *node )
 {
-    std::string id = solutionID ( source, listener );
+    return m_reciprocal ? node->m_new_source_position : node->m_new_listener_position;
+}
+
+void Solver::applySourceMovementMajor( struct SolutionNode *node, const EL::Vector3& position, double time )
+{
+    node->m_new_source_position = position;
     
-    m_request_for_stop = true;
+    // With the trees rooted at the listeners a moving source only
+    // needs an update
+    if( m_reciprocal ){ node->m_listener_status_major = CHANGED; }
+    else
+    {
+        if( node->m_move_time == 0 ){ node->m_move_time = time; }
+        node->m_geom_or_source_status = CHANGED;
+        node->m_request_for_stop = true;
+    }
+}
+
+void Solver::applyListenerMovementMajor( struct SolutionNode *node, const EL::Vector3& position, const EL::Matrix3& orientation, double time )
+{
+    //  cout << "Listener moved to " << position[0] << "," << position[1] << "," << position[2] << endl;
     
-    //  int next = ((m_current+1)&1);
-    //  int next = ((m_current+1) % 20);
-    //  m_reader->getRoom(m_room[next]);
-    //  m_current = next;
+    node->m_new_listener_position = position;
+    node->m_new_listener_orientation = orientation;
     
-    //  cout << "The new official geometry is " << m_current << endl;
+    // And a moving listener needs new trees
+    if( m_reciprocal )
+    {
+        if( node->m_move_time == 0 ){ node->m_move_time = time; }
+        node->m_geom_or_source_status = CHANGED;
+        node->m_request_for_stop = true;
+    }
+    else{ node->m_listener_status_major = CHANGED; }
+}
+
+void Solver::applyListenerMovementMinor( struct SolutionNode *node, const EL::Matrix3& orientation )
+{
+    node->m_new_listener_orientation = orientation;
+    node->m_listener_status_minor = CHANGED;
+}
+
+void Solver::applySourceMovementMinor( struct SolutionNode *node, const EL::Matrix3& orientation )
+{
+    node->m_new_source_orientation = orientation;
+    node->m_source_status_minor = CHANGED;
+}
+
+void Solver::applySourceMovementPrediction( struct SolutionNode *node, const EL::Vector3& position )
+{
+    node->m_predicted_source_position = position;
+    node->m_prediction_status = CHANGED;
+}
+
+static bool isMoreUrgent( const Solver::SolutionNode *a, const Solver::SolutionNode *b )
+{
+    if( a->m_geometry_changed != b->m_geometry_changed ){ return a->m_geometry_changed; }
+    return a->m_audibility > b->m_audibility;
+}
+
+void Solver::sortByPriority( t_solutionNodeList& nodes )
+{
+    // The pairs of a new geometry or just created come first, then the
+    // loudest by distance and the priorities of their source and listener
+    for( int i = 0; i < (int)nodes.size(); i++ )
+    {
+        struct SolutionNode *node = nodes[i];
+        float distance = ( node->m_new_source_position - node->m_new_listener_position ).length ();
+        node->m_audibility = m_source_priorities[node->m_source_handle] * m_listener_priorities[node->m_listener_handle] /
+                             max ( distance * distance, 0.01f );
+    }
+    std::stable_sort ( nodes.begin (), nodes.end (), isMoreUrgent );
+}
+
+void Solver::interruptCalculation()
+{
+    // Signal the calculation thread to stop, the job is finished once the
+    // solver thread has noticed
+    m_next_job->cancel ();
+    COUT << "Stopping calculation with old data" << "\n";
+}
+
+void Solver::finishCalculation()
+{
+    std::vector<SolveJob::Target>& targets = m_next_job->m_targets;
+    
+    if( m_next_job->isCancelled () )
+    {
+        COUT << "Stopped calculation with old data" << "\n";
+        
+        if( m_next_job->m_speculative )
+        {
+            m_recent_trees.m_speculative_misses++;
+            COUT << "Dropped the speculative beam tree ( predictions: " << getPredictionHits () << " hits, "
+                 << getPredictionMisses () << " misses )" << "\n";
+        }
+        
+        for( int i = 0; i < (int)targets.size(); i++ )
+        {
+            // A solution already in use keeps its completed orders until replaced
+            if( !targets[i].m_in_use ){ delete targets[i].m_solution; }
+            
+            // A prediction joined but never used gave no paths
+            if( !targets[i].m_in_use && targets[i].m_node->m_predicted_tree == m_next_job->m_tree )
+            {
+                m_recent_trees.m_speculative_misses++;
+                targets[i].m_node->m_predicted_tree = 0;
+            }
+            
+            // The interrupted pair still needs its new solution
+            if( m_next_job->m_progressive && targets[i].m_node->m_geom_or_source_status == IN_PROCESS )
+            {
+                targets[i].m_node->m_geom_or_source_status = CHANGED;
+            }
+        }
+    }
+    else
+    {
+        for( int i = 0; i < (int)targets.size(); i++ )
+        {
+            struct SolutionNode *node = targets[i].m_node;
+            
+            if( !targets[i].m_in_use ){ takeSolutionIntoUse ( node, targets[i].m_solution ); }
+            
+            if( node->m_geom_or_source_status == IN_PROCESS )
+            {
+                if( m_next_job->m_progressive ){ recordLatency ( node ); }
+                node->m_geom_or_source_status = UPDATED;
+            }
+            
+            node->m_to_send = true;
+            node->m_listener_status_major = CHANGED;
+            
+            COUT << "Finished the next solution ( m_current = " << node->m_current << " ) " << "\n";
+        }
+        
+        m_recent_trees.insert ( m_next_job->m_tree, m_next_job->m_reciprocal, m_next_job->m_speculative );
+        if( m_next_job->m_progressive ){ tuneInitialOrder ( m_next_job ); }
+        
+        // Reported in any build, the library only logs with debug logs on
+        if( m_next_job->m_tree->isTruncated () )
+        {
+            m_truncated_trees++;
+            cout << "The beam tree was truncated at order " << m_next_job->m_tree->getCompletedOrder ()
+                 << " with " << m_next_job->m_tree->getNumNodes () << " nodes ( "
+                 << m_truncated_trees << " trees truncated so far )" << endl;
+        }
+    }
+    
+    delete m_next_job;
+    m_next_job = 0;
+}
+
+void Solver::prepareNextSolution( struct SolutionNode *node )
+{
+    node->m_geom_or_source_status = IN_PROCESS;
+    node->m_request_for_stop = false;
+    int next = (node->m_current+1)&1;
+    node->m_source[next].setPosition ( node->m_new_source_position );
+    node->m_source[next].setOrientation ( node->m_new_source_orientation );
+    node->m_listener[next].setPosition ( node->m_new_listener_position );
+    node->m_listener[next].setOrientation( node->m_new_listener_orientation );
+}
+
+void Solver::snapToRoot( struct SolutionNode *node, const EL::Vector3& root )
+{
+    // A tree rooted within a grid step is used as if built where the pair
+    // is: the solution is validated from the root of the tree, the paths
+    // then start up to a grid step away from the actual position
+    float offset = ( root - getRootPosition ( node ) ).length ();
+    if( offset == 0.f ){ return; }
+    
+    int next = (node->m_current+1)&1;
+    if( m_reciprocal ){ node->m_listener[next].setPosition ( root ); }
+    else{ node->m_source[next].setPosition ( root ); }
+    COUT << "The paths are approximated from a tree rooted " << offset << " m away" << "\n";
+}
+
+void Solver::createNewSolution( int depth, struct SolutionNode *node, bool progressive )
+{
+    COUT << "Creating new solution upto level " << depth << " from geometry " << m_current_room << "\n";
+    EL::BeamTree *tree = new EL::BeamTree (*m_room,
+                                           getRootPosition ( node ),
+                                           getTargetPosition ( node ),
+                                           depth);
+    tree->setNodeLimit ( getNodeLimit ( node ) );
+    tree->setBestFirst ( m_best_first );
+    tree->setCache ( m_tree_cache );
+    m_next_job = new SolveJob ( tree, progressive, m_reciprocal );
+    addSolutionToJob ( node );
+    
+    // Signal calculation thread to start
+    signalCalculation ();
+}
+
+void Solver::createSpeculativeSolution( struct SolutionNode *node )
+{
+    COUT << "Creating a speculative solution upto level " << m_max_depth << " at a predicted source position" << "\n";
+    EL::BeamTree *tree = new EL::BeamTree (*m_room,
+                                           node->m_predicted_source_position,
+                                           node->m_new_listener_position,
+                                           m_max_depth);
+    tree->setNodeLimit ( getNodeLimit ( node ) );
+    tree->setBestFirst ( m_best_first );
+    tree->setCache ( m_tree_cache );
+    m_next_job = new SolveJob ( tree, false, false );
+    m_next_job->m_predicted = true;
+    m_next_job->m_speculative = true;
     
-    t_solutionNodeIterator it = m_solutionNodeMap.find(id);
+    // Signal calculation thread to start
+    signalCalculation ();
+}
+
+bool Solver::isPredictedSolution( struct SolutionNode *node )
+{
+    return m_next_job && m_next_job->m_predicted && !m_next_job->isCancelled () && !m_reciprocal &&
+           &m_next_job->m_tree->getRoom () == &m_room->getRoom () &&
+           m_recent_trees.isClose ( m_next_job->m_tree->getSource (), node->m_new_source_position );
+}
+
+int Solver::getNodeLimit( struct SolutionNode *node )
+{
+    if( m_total_node_limit <= 0 ){ return m_node_limit; }
     
-    if( it != m_solutionNodeMap.end() )
+    // The nodes of the other trees in use count against the total, except
+    // the tree the new one replaces. A tree may be growing on the path
+    // solver thread, its number of nodes is published atomically
+    std::set<EL::BeamTree *> trees;
+    for( t_solutionNodeIterator it = m_solutionNodes.begin(); it != m_solutionNodes.end() ; it++ )
     {
-        it->second->m_new_source_position = source.getPosition ();
-        it->second->m_geom_or_source_status = CHANGED;
+        if( (*it)->m_solution && (*it) != node ){ trees.insert ( (*it)->m_solution->getBeamTree () ); }
     }
+    if( node->m_solution ){ trees.erase ( node->m_solution->getBeamTree () ); }
+    
+    int available = m_total_node_limit;
+    for( std::set<EL::BeamTree *>::iterator t = trees.begin(); t != trees.end(); t++ ){ available -= (*t)->getNumNodes (); }
+    
+    // Always leave room for the direct path
+    if( available < 1 ){ available = 1; }
+    if( m_node_limit > 0 && m_node_limit < available ){ available = m_node_limit; }
+    return available;
 }
 
-void Solver::markListenerMovementMajor( const EL::Source& source, const EL::Listener& listener )
+void Solver::recordLatency( struct SolutionNode *node )
 {
-    std::string id = solutionID ( source, listener );
+    if( node->m_move_time == 0 ){ return; }
+    node->m_latency = 1000 * ( getTime () - node->m_move_time );
+    node->m_move_time = 0;
+}
+
+void Solver::tuneInitialOrder( SolveJob *job )
+{
+    if( m_latency_target <= 0 ){ return; }
     
-    t_solutionNodeIterator it = m_solutionNodeMap.find(id);
+    // Growth of the solve time from one order to the next, from the time
+    // spent on each of the last two orders
+    const std::vector<double>& times = job->m_order_times;
+    int order = (int)times.size () - 1;
+    if( order >= 3 )
+    {
+        double last = times[order] - times[order-1], previous = times[order-1] - times[order-2];
+        if( previous > 0.001 && last > 0.001 ){ m_order_growth = max ( 1.5, min ( 10.0, last / previous ) ); }
+    }
     
-    const EL::Vector3& p = listener.getPosition();
-    const EL::Matrix3& m = listener.getOrientation();
+    // The slowest pair of the job decides
+    float latency = -1;
+    for( int i = 0; i < (int)job->m_targets.size(); i++ ){ latency = max ( latency, job->m_targets[i].m_node->m_latency ); }
+    if( latency < 0 ){ return; }
     
-    //  cout << "Listener moved to " << p[0] << "," << p[1] << "," << p[2] << endl;
+    order = job->m_tree->getOrder ();
+    if( (int)m_initial_latencies.size () <= order ){ m_initial_latencies.resize ( order + 1, -1 ); }
+    m_initial_latencies[order] = latency;
     
-    if( it != m_solutionNodeMap.end() )
+    // One order at a time, up only when the next order is known or expected
+    // to fit too
+    if( latency > m_latency_target && m_min_depth > 1 ){ m_min_depth--; }
+    else if( latency <= m_latency_target && m_min_depth < m_max_depth )
     {
-        it->second->m_new_listener_position = p;
-        it->second->m_new_listener_orientation = m;
-        it->second->m_listener_status_major = CHANGED;
+        float next = ( m_min_depth + 1 < (int)m_initial_latencies.size () ) ? m_initial_latencies[m_min_depth+1] : -1;
+        if( next < 0 ){ next = latency * m_order_growth; }
+        if( next < m_latency_target ){ m_min_depth++; }
     }
+    reportLatency ();
 }
 
-void Solver::markListenerMovementMinor( const EL::Source& source, const EL::Listener& listener )
+void Solver::tuneMaximumOrder()
 {
-    std::string id = solutionID ( source, listener );
-    t_solutionNodeIterator it = m_solutionNodeMap.find(id);
+    if( m_latency_target <= 0 ){ return; }
     
-    const EL::Matrix3& ori = listener.getOrientation();
-    it->second->m_new_listener_orientation = ori;
-    it->second->m_listener_status_minor = CHANGED;
+    // The slowest update of each order since the last call, each update
+    // counted once
+    std::vector<float> updates;
+    for( t_solutionNodeIterator it = m_solutionNodes.begin(); it != m_solutionNodes.end() ; it++ )
+    {
+        struct SolutionNode *node = (*it);
+        if( !node->m_solution || node->m_update_time < 0 ){ continue; }
+        
+        int solutionOrder = node->m_solution->getOrder ();
+        if( (int)updates.size () <= solutionOrder ){ updates.resize ( solutionOrder + 1, -1 ); }
+        updates[solutionOrder] = max ( updates[solutionOrder], node->m_update_time );
+        node->m_update_time = -1;
+    }
+    if( m_update_latencies.size () < updates.size () )
+    {
+        m_update_latencies.resize ( updates.size (), -1 );
+        m_update_misses.resize ( updates.size (), 0 );
+        m_update_stamps.resize ( updates.size (), 0 );
+    }
+    
+    // Smooth the times of each order and count its updates in a row over the
+    // target, forget the orders not run for a while as they may fit again.
+    // Only repeated too slow updates cap the maximum order below them
+    int order = m_max_depth;
+    double now = getTime ();
+    for( int i = 0; i < (int)m_update_latencies.size (); i++ )
+    {
+        if( i < (int)updates.size () && updates[i] >= 0 )
+        {
+            if( m_update_latencies[i] < 0 ){ m_update_latencies[i] = updates[i]; }
+            else{ m_update_latencies[i] += LATENCY_SMOOTHING * ( updates[i] - m_update_latencies[i] ); }
+            m_update_misses[i] = ( updates[i] > m_latency_target ) ? m_update_misses[i] + 1 : 0;
+            m_update_stamps[i] = now;
+        }
+        else if( m_update_latencies[i] >= 0 && now - m_update_stamps[i] > LATENCY_EXPIRY )
+        {
+            m_update_latencies[i] = -1;
+            m_update_misses[i] = 0;
+        }
+        if( i <= m_max_depth && m_update_misses[i] >= LATENCY_MISSES ){ m_max_depth = max ( 1, i - 1 ); }
+    }
+    
+    // Deeper when the smoothed time of the maximum order fits, and the next
+    // order is known or expected to fit too
+    bool measured = ( order < (int)updates.size () && updates[order] >= 0 );
+    if( m_max_depth == order && measured && m_update_latencies[order] <= m_latency_target && m_max_depth < LATENCY_MAX_ORDER )
+    {
+        float next = ( order + 1 < (int)m_update_latencies.size () ) ? m_update_latencies[order+1] : -1;
+        if( next < 0 ){ next = m_update_latencies[order] * m_order_growth; }
+        if( next < m_latency_target ){ m_max_depth++; }
+    }
+    m_min_depth = min ( m_min_depth, m_max_depth );
+    if( m_max_depth != order ){ reportLatency (); }
+}
+
+void Solver::restoreRoomOrders()
+{
+    // Each room starts from the orders it was last tuned to, the times
+    // measured in another room do not apply
+    if( m_latency_target > 0 )
+    {
+        if( m_tuned_room >= 0 ){ m_room_orders[m_tuned_room_hash] = std::make_pair ( m_min_depth, m_max_depth ); }
+        
+        std::map<unsigned long long, std::pair<int, int> >::iterator it = m_room_orders.find ( m_room->getRoom ().getHash () );
+        if( it != m_room_orders.end () )
+        {
+            m_min_depth = it->second.first;
+            m_max_depth = it->second.second;
+            COUT << "Orders " << m_min_depth << " - " << m_max_depth << " restored for the room" << "\n";
+        }
+        m_initial_latencies.clear ();
+        m_update_latencies.clear ();
+        m_update_misses.clear ();
+        m_update_stamps.clear ();
+    }
+    m_tuned_room = m_current_room;
+    m_tuned_room_hash = m_room->getRoom ().getHash ();
 }
 
-void Solver::markSourceMovementMinor( const EL::Source& source, const EL::Listener& listener )
+void Solver::reportLatency()
 {
-    std::string id = solutionID ( source, listener );
-    t_solutionNodeIterator it = m_solutionNodeMap.find(id);
+    float latency = -1;
+    for( t_solutionNodeIterator it = m_solutionNodes.begin(); it != m_solutionNodes.end() ; it++ )
+    {
+        latency = max ( latency, (*it)->m_latency );
+    }
     
-    const EL::Matrix3& ori = source.getOrientation();
-    it->second->m_new_source_orientation = ori;
-    it->second->m_source_status_minor = CHANGED;
+    COUT << "Orders " << m_min_depth << " - " << m_max_depth << " for a latency of " << latency
+         << " ms and updates of " << m_last_update_time << " ms ( target " << m_latency_target << " ms )" << "\n";
+    for( int i = 0; i < (int)m_writers.size(); i++ )
+    {
+        m_writers[i]->postLatency ( m_min_depth, m_max_depth, latency, m_last_update_time, m_latency_target );
+        COUT << "The " << m_writers[i]->getType() << " writer has " << m_writers[i]->getQueueDepth() << " messages queued, "
+             << m_writers[i]->getDroppedMessages() << " replaced or dropped so far" << "\n";
+    }
 }
 
-void Solver::interruptCalculation()
+void Solver::addSolutionToJob( struct SolutionNode *node )
 {
-    // Signal the calculation thread to stop
+    prepareNextSolution ( node );
+    snapToRoot ( node, m_next_job->m_tree->getSource () );
+    int next = (node->m_current+1)&1;
     
-    EL::setStopSignalValue(true);
-    // added usleep to avoid blocking while loop in osx (postponing the complete re-write? true :)  
-    while (!m_next_solution_flag){ usleep(1); };
-    EL::setStopSignalValue(false);
+    SolveJob::Target target;
+    target.m_node = node;
+    target.m_solution = new EL::PathSolution (m_next_job->m_tree,
+                                              node->m_source[next],
+                                              node->m_listener[next],
+                                              true,
+                                              m_reciprocal);
+    target.m_in_use = false;
+    m_next_job->m_targets.push_back ( target );
+}
+
+bool Solver::shareBeamTree( struct SolutionNode *node )
+{
+    const EL::Room *room = &m_room->getRoom ();
+    
+    // Join the running calculation if it is for the same root position
+    if( m_next_job && m_next_job->m_progressive && !m_next_job->isCancelled () &&
+        m_next_job->m_reciprocal == m_reciprocal && &m_next_job->m_tree->getRoom () == room &&
+        m_next_job->m_tree->getSource () == getRootPosition ( node ) )
+    {
+        COUT << "Sharing the beam tree being calculated" << "\n";
+        addSolutionToJob ( node );
+        return true;
+    }
     
-    pthread_mutex_lock (&next_solution_mutex);
-    m_next_solution_flag = false;
-    pthread_mutex_unlock (&next_solution_mutex);
+    // Or the tree being calculated ahead where the source has landed, its
+    // orders are published as they complete
+    if( isPredictedSolution ( node ) )
+    {
+        if( m_next_job->m_speculative ){ node->m_predicted_tree = m_next_job->m_tree; }
+        m_next_job->m_speculative = false;
+        m_next_job->m_progressive = true;
+        COUT << "Joining the speculative beam tree ( predictions: " << getPredictionHits () << " hits, "
+             << getPredictionMisses () << " misses )" << "\n";
+        addSolutionToJob ( node );
+        return true;
+    }
     
-    COUT << "Stopped calculation with old data" << "\n";
-    if (m_next_solution){ delete m_next_solution; }
-}  
+    // Or use the complete tree of another pair, a single update() is enough
+    for( t_solutionNodeIterator it = m_solutionNodes.begin(); it != m_solutionNodes.end() ; it++ )
+    {
+        struct SolutionNode *other = (*it);
+        if( other == node || !other->m_solution ){ continue; }
+        
+        EL::BeamTree *tree = other->m_solution->getBeamTree ();
+        if( m_next_job && tree == m_next_job->m_tree ){ continue; }
+        
+        if( other->m_solution->isReciprocal () == m_reciprocal && &tree->getRoom () == room &&
+            tree->getSource () == getRootPosition ( node ) && tree->isComplete () )
+        {
+            COUT << "Sharing the beam tree of the solution " << solutionID ( other->m_solution ) << "\n";
+            useBeamTree ( node, tree );
+            return true;
+        }
+    }
+    
+    // Or a tree built recently close to the root position
+    EL::BeamTree *tree = m_recent_trees.find ( room, getRootPosition ( node ), m_reciprocal );
+    if( tree && !( m_next_job && tree == m_next_job->m_tree ) )
+    {
+        COUT << "Reusing a recent beam tree of order " << tree->getOrder () << " ( " << m_recent_trees.m_hits << " reuses, predictions: "
+             << getPredictionHits () << " hits, " << getPredictionMisses () << " misses )" << "\n";
+        useBeamTree ( node, tree );
+        return true;
+    }
+    return false;
+}
 
-void Solver::createNewSolution( int depth, const EL::Source& source, const EL::Listener& listener )
+void Solver::useBeamTree( struct SolutionNode *node, EL::BeamTree *tree )
 {
-    COUT << "Creating new solution upto level " << depth << " from geometry " << m_current_room << "\n";
-    m_next_solution = new EL::PathSolution (m_room[m_current_room],
-                                            source,
-                                            listener,
-                                            depth,
-                                            true);
+    prepareNextSolution ( node );
+    snapToRoot ( node, tree->getSource () );
+    int next = (node->m_current+1)&1;
+    takeSolutionIntoUse ( node, new EL::PathSolution (tree, node->m_source[next], node->m_listener[next], true, m_reciprocal) );
+    recordLatency ( node );
+    node->m_geom_or_source_status = UPDATED;
+    node->m_listener_status_major = CHANGED;
+}
+
+void Solver::takeSolutionIntoUse( struct SolutionNode *node, EL::PathSolution *solution )
+{
+    COUT << "New solution will be taken into use." << "\n";
     
-    // Signal calculation thread to start
-    calculate_signal = true;
+    if( node->m_solution ){ delete node->m_solution; }
+    node->m_solution = solution;
+    node->m_solution->setUpdatePool ( m_update_pool );
+    node->m_update_time = -1;
+    node->m_geometry_changed = false;
+    node->m_current = (node->m_current + 1)&1;
 }
 
-void Solver::markGeometryChanged ()
+void Solver::applyGeometryChange ( std::vector<EL::Room::Element>& elements, double time )
 {
     COUT << "Geometry has changed!.";
     
-    // adding the isLoadingNewRoom flag to make sure no computation will start before
-    // m_reader->getRoom ( m_room[next] ) is executed AND m_current_room is updated
-    // (to avoid using geometry 0 while it's geometry 1 that has just been defined.
-    // would happend e.g. when markSourceMovementMajor() was called in parallel with
-    // markGeometryChanged(). For the same kind of reason, isLoadingNewRoom initial
-    // value is set to true at startup)
-    isLoadingNewRoom = true;
-    int next = (( m_current_room + 1 ) % 20);
-    m_reader->getRoom ( m_room[next] );
-    m_current_room = next;
+    // The geometry is applied on the main loop like the other changes, no
+    // computation starts before the first one. The trees of the old room
+    // keep it until they are released
+    EL::RoomSnapshot *room = new EL::RoomSnapshot;
+    room->getRoom ().setElements ( elements );
+    room->addReference ();
+    m_room->removeReference ();
+    m_room = room;
+    m_current_room++;
     
     COUT << "The new official geometry is " << m_current_room << "\n";
     
-    for( t_solutionNodeIterator it = m_solutionNodeMap.begin(); it != m_solutionNodeMap.end() ; it++ )
+    for( t_solutionNodeIterator it = m_solutionNodes.begin(); it != m_solutionNodes.end() ; it++ )
     {
-        it->second->m_geom_or_source_status = CHANGED;
+        if( (*it)->m_move_time == 0 ){ (*it)->m_move_time = time; }
+        (*it)->m_geom_or_source_status = CHANGED;
+        (*it)->m_geometry_changed = true;
     }
 
     m_request_for_stop = true;
@@ -343,172 +1386,254 @@ void Solver::markGeometryChanged ()
 
 void Solver::update ()
 {
-    //  cout << "Starting the update round " << calculate_signal << "," << EL::getStopSignalValue() << endl;
-    //  sleep(1);
+    applyCommands ();
     
-    if(m_newSolutionNodesAvailable){ mapAvailableSolutionNodes (); }
+    // The recent trees of an older geometry are never reused
+    if( !isLoadingNewRoom && m_recent_trees_room != m_current_room )
+    {
+        m_recent_trees.clear ();
+        m_recent_trees_room = m_current_room;
+    }
+    if( !isLoadingNewRoom && m_tuned_room != m_current_room ){ restoreRoomOrders (); }
     
-    if( m_request_for_stop && !isLoadingNewRoom )
+    // Stop the running calculation if its geometry or source is outdated,
+    // the calculations of the other pairs are left alone
+    if( m_next_job && !isLoadingNewRoom && !m_next_job->isCancelled () )
     {
-        if ( ! m_start_new ){ interruptCalculation(); }
-        m_request_for_stop = false;
-        m_start_new = true;
+        bool stop = m_request_for_stop;
+        for( int i = 0; i < (int)m_next_job->m_targets.size(); i++ )
+        {
+            if( m_next_job->m_targets[i].m_node->m_request_for_stop ){ stop = true; }
+        }
+        
+        // A deepening or speculative calculation gives way to the pairs
+        // that need a new tree elsewhere
+        if( !m_next_job->m_progressive )
+        {
+            for( t_solutionNodeIterator it = m_solutionNodes.begin(); it != m_solutionNodes.end() ; it++ )
+            {
+                if( (*it)->m_geom_or_source_status == CHANGED && !isPredictedSolution ( (*it) ) ){ stop = true; }
+            }
+        }
+        if( stop ){ interruptCalculation(); }
     }
+    if( !isLoadingNewRoom ){ m_request_for_stop = false; }
     
-    // Do we have a solution to be swapped into use ?
+    // Publish the orders completed so far by a progressive solution
     
-    if( m_next_solution_flag )
+    if( m_next_job && m_next_job->m_progressive && !m_next_job->isCancelled () )
     {
-        COUT << "New solution will be taken into use." << "\n";
-        if( m_solutionNodeMap[ solutionID ( m_next_solution) ]->m_solution )
+        int order = m_next_job->getCompletedOrder ();
+        bool publish = ( order > m_next_job->m_published_order );
+        if( publish )
         {
-            delete m_solutionNodeMap[ solutionID ( m_next_solution) ]->m_solution;
+            COUT << "Publishing order " << order << " of the beam tree to " << m_next_job->m_targets.size() << " solutions" << "\n";
+            m_next_job->m_published_order = order;
         }
         
-        m_solutionNodeMap[ solutionID ( m_next_solution) ]->m_solution = m_next_solution;
-        
-        if( m_solutionNodeMap[ solutionID ( m_next_solution) ]->m_geom_or_source_status == IN_PROCESS )
+        // Solutions joining after the first order get the published ones at once
+        for( int i = 0; i < (int)m_next_job->m_targets.size(); i++ )
         {
-            m_solutionNodeMap[ solutionID ( m_next_solution) ]->m_geom_or_source_status = UPDATED;
+            SolveJob::Target& target = m_next_job->m_targets[i];
+            if( order < 0 || ( target.m_in_use && !publish ) ){ continue; }
+            
+            if( !target.m_in_use )
+            {
+                takeSolutionIntoUse ( target.m_node, target.m_solution );
+                target.m_in_use = true;
+            }
+            target.m_node->m_to_send = true;
+            target.m_node->m_listener_status_major = CHANGED;
         }
-        
-        m_solutionNodeMap[ solutionID ( m_next_solution) ]->m_to_send = true;
-        m_solutionNodeMap[ solutionID ( m_next_solution) ]->m_listener_status_major = CHANGED;
-        m_solutionNodeMap[ solutionID ( m_next_solution) ]->m_current =
-        (m_solutionNodeMap[ solutionID ( m_next_solution) ]->m_current + 1)&1;
-        
-        COUT << "Clearing the next solution flag ( m_current = " << m_solutionNodeMap[ solutionID (m_next_solution) ]->m_current << " ) " << "\n";
-        
-        pthread_mutex_lock (&next_solution_mutex);
-        m_next_solution_flag = false;
-        pthread_mutex_unlock (&next_solution_mutex);
-        
-        m_start_new = true;
     }
     
-    if( m_start_new )
+    // Do we have a solution to be swapped into use ?
+    
+    if( m_next_job && m_next_job->isDone () ){ finishCalculation (); }
+    
+    if( !m_next_job && !isLoadingNewRoom )
     {
-        // Loop all the solutions, and start _one_ new calculation if
+        t_solutionNodeList nodes ( m_solutionNodes );
+        sortByPriority ( nodes );
+        
+        // Loop all the solutions by priority, and start _one_ new calculation if
         // 1) geometry or source has changed
-        for( t_solutionNodeIterator it = m_solutionNodeMap.begin();
-            (( it != m_solutionNodeMap.end() ) && ( m_start_new && !isLoadingNewRoom )) ; it++ )
+        for( t_solutionNodeIterator it = nodes.begin();
+            (( it != nodes.end() ) && ( !m_next_job && !isLoadingNewRoom )) ; it++ )
         {
-            if (it->second->m_geom_or_source_status == CHANGED)
+            if ((*it)->m_geom_or_source_status == CHANGED)
             {
-                COUT << "Geometry or source changed: " << solutionID ( it->second->m_source[0], it->second->m_listener[0] ) << "\n";
-                it->second->m_geom_or_source_status = IN_PROCESS;
-                int next = (it->second->m_current+1)&1;
-                it->second->m_source[next].setPosition ( it->second->m_new_source_position );
-                it->second->m_source[next].setOrientation ( it->second->m_new_source_orientation );
-                it->second->m_listener[next].setPosition ( it->second->m_new_listener_position );
-                it->second->m_listener[next].setOrientation( it->second->m_new_listener_orientation );
-                createNewSolution (m_min_depth, it->second->m_source[next], it->second->m_listener[next]);
-                m_start_new = false;
+                COUT << "Geometry or source changed: " << solutionID ( (*it)->m_source[0], (*it)->m_listener[0] ) << "\n";
+                if( !shareBeamTree ( (*it) ) ){ createNewSolution (m_min_depth, (*it), true); }
             }
         }
         // 2) maximum order is not reached
-        for( t_solutionNodeIterator it = m_solutionNodeMap.begin();
-            (( it != m_solutionNodeMap.end() ) && ( m_start_new && !isLoadingNewRoom )) ; it++ )
+        for( t_solutionNodeIterator it = nodes.begin();
+            (( it != nodes.end() ) && ( !m_next_job && !isLoadingNewRoom )) ; it++ )
         {
-            if (it->second->m_solution)
+            if ((*it)->m_solution)
             {
-                if (it->second->m_solution->getOrder () < m_max_depth)
+                // A truncated tree would be truncated again at the same size
+                if ((*it)->m_solution->getOrder () < m_max_depth && !(*it)->m_solution->getBeamTree ()->isTruncated ())
                 {
-                    COUT << "Deepening the solution: " << solutionID ( it->second->m_source[0], it->second->m_listener[0] ) << "\n";
-                    it->second->m_geom_or_source_status = IN_PROCESS;
-                    int next = (it->second->m_current+1)&1;
-                    it->second->m_source[next].setPosition ( it->second->m_new_source_position );
-                    it->second->m_source[next].setOrientation ( it->second->m_new_source_orientation );
-                    it->second->m_listener[next].setPosition ( it->second->m_new_listener_position );
-                    it->second->m_listener[next].setOrientation ( it->second->m_new_listener_orientation );
-                    createNewSolution (it->second->m_solution->getOrder() + 1, it->second->m_source[next], it->second->m_listener[next]);
-                    m_start_new = false;
+                    COUT << "Deepening the solution: " << solutionID ( (*it)->m_source[0], (*it)->m_listener[0] ) << "\n";
+                    EL::BeamTree *tree = (*it)->m_solution->getBeamTree ();
+                    createNewSolution (tree->getOrder() + 1, (*it), false);
+                    
+                    // The other pairs on the same tree get the deeper one too
+                    for( t_solutionNodeIterator other = m_solutionNodes.begin(); other != m_solutionNodes.end() ; other++ )
+                    {
+                        if( (*other) != (*it) && (*other)->m_solution &&
+                            (*other)->m_solution->getBeamTree () == tree &&
+                            (*other)->m_geom_or_source_status != CHANGED )
+                        {
+                            addSolutionToJob ( (*other) );
+                        }
+                    }
                 }
             }
         }
+        // 3) nothing else to do: solve ahead where a source is heading
+        for( t_solutionNodeIterator it = nodes.begin();
+            (( it != nodes.end() ) && ( !m_next_job && !isLoadingNewRoom )) ; it++ )
+        {
+            struct SolutionNode *node = (*it);
+            if( node->m_prediction_status != CHANGED ){ continue; }
+            node->m_prediction_status = UPDATED;
+            
+            if( m_reciprocal || !m_recent_trees.isEnabled () ||
+                m_recent_trees.contains ( &m_room->getRoom (), node->m_predicted_source_position, false ) ){ continue; }
+            createSpeculativeSolution ( node );
+        }
+    }
+    
+    // The other pairs whose geometry or source changed share a beam tree if
+    // one is built or being built for their source position
+    for( t_solutionNodeIterator it = m_solutionNodes.begin();
+        (( it != m_solutionNodes.end() ) && !isLoadingNewRoom) ; it++ )
+    {
+        if ((*it)->m_geom_or_source_status == CHANGED){ shareBeamTree ( (*it) ); }
     }
         
 
     // See if the listener position has changed, and update the solutions accordingly
     // and finally write the changed solutions out
     
-    for( t_solutionNodeIterator it = m_solutionNodeMap.begin();
-        it != m_solutionNodeMap.end() ; it++ )
+    bool updated = false;
+    for( t_solutionNodeIterator it = m_solutionNodes.begin();
+        it != m_solutionNodes.end() ; it++ )
     {
-        if (it->second->m_solution)
+        if ((*it)->m_solution)
         {
-            //	cout << "Ready to update solution: " << solutionID ( it->second->m_solution ) << endl;
-            if (it->second->m_listener_status_major == CHANGED)
+            //	cout << "Ready to update solution: " << solutionID ( (*it)->m_solution ) << endl;
+            if ((*it)->m_listener_status_major == CHANGED)
             {
-                COUT << "Updating the solution: " << solutionID ( it->second->m_solution ) << "\n";
-                it->second->m_listener_status_major = UPDATED;
-                it->second->m_listener[it->second->m_current].setPosition ( it->second->m_new_listener_position );
-                it->second->m_listener[it->second->m_current].setOrientation ( it->second->m_new_listener_orientation );
-                it->second->m_solution->update ();
-                it->second->m_to_send = true;
+                COUT << "Updating the solution: " << solutionID ( (*it)->m_solution ) << "\n";
+                (*it)->m_listener_status_major = UPDATED;
+                
+                // Move the end of the paths the tree is not rooted at
+                if( (*it)->m_solution->isReciprocal () )
+                {
+                    (*it)->m_source[(*it)->m_current].setPosition ( (*it)->m_new_source_position );
+                }
+                else
+                {
+                    (*it)->m_listener[(*it)->m_current].setPosition ( (*it)->m_new_listener_position );
+                }
+                (*it)->m_listener[(*it)->m_current].setOrientation ( (*it)->m_new_listener_orientation );
+                
+                // The solver thread may still be adding orders to this solution
+                bool solving = ( m_next_job && (*it)->m_solution->getBeamTree () == m_next_job->m_tree );
+                if( solving ){ pthread_mutex_lock (&m_next_job->m_tree_mutex); }
+                double start = getTime ();
+                (*it)->m_solution->update ();
+                (*it)->m_update_time = 1000 * ( getTime () - start );
+                m_last_update_time = (*it)->m_update_time;
+                if( solving ){ pthread_mutex_unlock (&m_next_job->m_tree_mutex); }
+                updated = true;
+                
+                // A prediction counts as a hit once its tree gives paths
+                if( (*it)->m_predicted_tree == (*it)->m_solution->getBeamTree () )
+                {
+                    if( (*it)->m_solution->numPaths () > 0 ){ m_recent_trees.m_speculative_hits++; }
+                    else{ m_recent_trees.m_speculative_misses++; }
+                    (*it)->m_predicted_tree = 0;
+                }
+                (*it)->m_to_send = true;
+                
+                COUT << "Occluder cache hits: " << (*it)->m_solution->getNumOccluderCacheHits ()
+                     << " of " << (*it)->m_solution->getNumOccludedPaths () << " occluded paths" << "\n";
             }
             
-            if (it->second->m_to_send)
+            if ((*it)->m_to_send)
             {
-                // Update output to all the writers of the solution node
-                for (std::vector<Writer *>::iterator w = it->second->m_writers.begin();
-                     w != it->second->m_writers.end(); w++)
+                // Update output to all the writers of the solution node, the
+                // output threads get one snapshot of the paths to share
+                SolutionSnapshot *snapshot = new SolutionSnapshot ( (*it)->m_solution, (*it)->m_source_handle, (*it)->m_listener_handle, true );
+                snapshot->addReference ();
+                for (std::vector<Writer *>::iterator w = (*it)->m_writers.begin();
+                     w != (*it)->m_writers.end(); w++)
                 {
-                    COUT << "Sending the solution " << solutionID ( it->second->m_solution ) << " with the " << (*w)->getType() << " protocol." << "\n";
-                    (*w)->writeMajor ( it->second->m_solution );
-                    it->second->m_to_send = false;
+                    COUT << "Sending the solution " << solutionID ( (*it)->m_solution ) << " with the " << (*w)->getType() << " protocol." << "\n";
+                    (*w)->postMajor ( snapshot );
+                    (*it)->m_to_send = false;
                 }
+                snapshot->removeReference ();
             }
             
             // check if listener orientation has changed
-            if (it->second->m_listener_status_minor == CHANGED)
+            if ((*it)->m_listener_status_minor == CHANGED)
             {
-                it->second->m_listener_status_minor = UPDATED;
-                it->second->m_listener[it->second->m_current].setOrientation ( it->second->m_new_listener_orientation );
+                (*it)->m_listener_status_minor = UPDATED;
+                (*it)->m_listener[(*it)->m_current].setOrientation ( (*it)->m_new_listener_orientation );
                 // Update output to the Auralization writer (only) of the solution node (writeReduce methods of other writers are dummies)
-                for (std::vector<Writer *>::iterator w = it->second->m_writers.begin();
-                     w != it->second->m_writers.end(); w++)
+                SolutionSnapshot *snapshot = new SolutionSnapshot ( (*it)->m_solution, (*it)->m_source_handle, (*it)->m_listener_handle, false );
+                snapshot->addReference ();
+                for (std::vector<Writer *>::iterator w = (*it)->m_writers.begin();
+                     w != (*it)->m_writers.end(); w++)
                 {
-                    COUT << "listener moved, sending additional info on solution " << solutionID ( it->second->m_solution ) << " with the " << (*w)->getType() << " protocol." << "\n";
-                    (*w)->writeMinor ( it->second->m_solution, 0 );
-                    it->second->m_to_send = false;
+                    COUT << "listener moved, sending additional info on solution " << solutionID ( (*it)->m_solution ) << " with the " << (*w)->getType() << " protocol." << "\n";
+                    (*w)->postMinor ( snapshot, 0 );
+                    (*it)->m_to_send = false;
                 }
+                snapshot->removeReference ();
             }
             
             // check if source orientation has changed
-            if (it->second->m_source_status_minor == CHANGED)
+            if ((*it)->m_source_status_minor == CHANGED)
             {
-                it->second->m_source_status_minor = UPDATED;
-                it->second->m_source[it->second->m_current].setOrientation ( it->second->m_new_source_orientation );
+                (*it)->m_source_status_minor = UPDATED;
+                (*it)->m_source[(*it)->m_current].setOrientation ( (*it)->m_new_source_orientation );
                 // Update output to the Auralization writer (only) of the solution node (writeReduce methods of other writers are dummies)
-                for (std::vector<Writer *>::iterator w = it->second->m_writers.begin();
-                     w != it->second->m_writers.end(); w++)
+                SolutionSnapshot *snapshot = new SolutionSnapshot ( (*it)->m_solution, (*it)->m_source_handle, (*it)->m_listener_handle, false );
+                snapshot->addReference ();
+                for (std::vector<Writer *>::iterator w = (*it)->m_writers.begin();
+                     w != (*it)->m_writers.end(); w++)
                 {
-                    COUT << "source moved, sending additional info on solution " << solutionID ( it->second->m_solution ) << " with the " << (*w)->getType() << " protocol." << "\n";
-                    (*w)->writeMinor ( it->second->m_solution, 1 );
-                    it->second->m_to_send = false;
+                    COUT << "source moved, sending additional info on solution " << solutionID ( (*it)->m_solution ) << " with the " << (*w)->getType() << " protocol." << "\n";
+                    (*w)->postMinor ( snapshot, 1 );
+                    (*it)->m_to_send = false;
                 }
+                snapshot->removeReference ();
             }
             
         }
     }
     
+    if( updated ){ tuneMaximumOrder (); }
+    
     m_ready_to_draw = true;
 }
 
 void *path_solver_function (void *data)
 {
+    Solver *solver = (Solver *)data;
     while (1)
     {
-        if( calculate_signal )
-        {
-            calculate_signal = false;
-            COUT << "Thread " << pthread_self() << " beginning new calculation" << "\n";
-            Solver *solver = (Solver *)data;
-            solver->calculateNextSolution ();
-            COUT << "Thread " << pthread_self() << " finished calculation" << "\n";
-        }
-        usleep( 2000 );
+        solver->waitForCalculation ();
+        COUT << "Thread " << pthread_self() << " beginning new calculation" << "\n";
+        solver->calculateNextSolution ();
+        COUT << "Thread " << pthread_self() << " finished calculation" << "\n";
     }
 }
 
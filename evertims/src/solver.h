@@ -36,6 +36,9 @@
 #define _SOLVER_H
 
 #include <pthread.h>
+#include <atomic>
+#include <list>
+#include <map>
 
 #include "elAABB.h"
 #include "elBeam.h"
@@ -49,7 +52,22 @@
 #include "reader.h"
 #include "writer.h"
 
-#define MAX_NUM_SOLUTIONS 64
+// Seconds of beam tree expansion per BeamTree::solve() call, bounds how
+// long the solver thread holds a tree away from the main loop
+#define SOLVE_TIME_BUDGET 0.005f
+
+// Deepest order the latency target may raise the maximum order to
+#define LATENCY_MAX_ORDER 12
+
+// Updates in a row over the latency target that cap the maximum order, the
+// weight of a new update time in the smoothed time of its order, and the
+// seconds after which the time of an order no longer run is forgotten
+#define LATENCY_MISSES 3
+#define LATENCY_SMOOTHING 0.25f
+#define LATENCY_EXPIRY 5.0
+
+// Commands the reader may post ahead of the main loop, a power of two
+#define COMMAND_QUEUE_SIZE 1024
 
 class Solver
 {
@@ -69,6 +87,7 @@ public:
         enum Status          m_listener_status_minor;
         enum Status          m_source_status_minor;
         enum Status          m_geom_or_source_status;
+        bool                 m_request_for_stop;
         bool                 m_to_send;
         // double buffering for the source and listener
         EL::Source           m_source[2];
@@ -81,26 +100,255 @@ public:
         EL::Matrix3          m_new_listener_orientation;
         EL::PathSolution     *m_solution;
         std::vector<Writer *> m_writers;
+        int                  m_source_handle;
+        int                  m_listener_handle;
+        
+        // Needs a tree for a new geometry or a new pair rather than a
+        // movement, and how loud the pair is for the scheduler
+        bool                 m_geometry_changed;
+        float                m_audibility;
+        
+        // Where the source is expected to land on its next major movement,
+        // and the tree built there once joined, until a first update tells
+        // whether the prediction gave paths
+        enum Status          m_prediction_status;
+        EL::Vector3          m_predicted_source_position;
+        EL::BeamTree         *m_predicted_tree;
+        
+        // Time of the first movement not served yet, and the last measured
+        // latency to a solution of the initial order and update time (ms)
+        double               m_move_time;
+        float                m_latency;
+        float                m_update_time;
+    };
+    
+    // A beam tree calculation running on the path solver thread. Doubles as
+    // completion handle: the main loop is woken when it is done and checks
+    // isDone(), or blocks in wait().
+    // The tree is shared by the solutions of all the pairs whose source is
+    // at its position.
+    struct SolveJob
+    {
+        struct Target
+        {
+            struct SolutionNode  *m_node;
+            EL::PathSolution     *m_solution;
+            bool                 m_in_use;
+        };
+        
+        SolveJob ( EL::BeamTree *tree, bool progressive, bool reciprocal );
+        ~SolveJob ();
+        
+        void run ( Solver *solver );
+        void cancel () { m_tree->cancel (); }
+        bool isCancelled () { return m_tree->isCancelled (); }
+        bool isDone ();
+        void wait ();
+        int  getCompletedOrder ();
+        
+        EL::BeamTree         *m_tree;
+        std::vector<Target>  m_targets;
+        
+        // A progressive solution replaces an outdated one as soon as its first
+        // order is complete, the remaining orders are filled in while in use
+        bool                 m_progressive;
+        int                  m_published_order;
+        
+        // The tree is rooted at the listener position
+        bool                 m_reciprocal;
+        
+        // Built ahead at a predicted source position, the pairs whose source
+        // lands within a grid step join and are snapped to its root.
+        // Speculative while no pair has joined, the tree then goes to the
+        // recent trees when done
+        bool                 m_predicted;
+        bool                 m_speculative;
+        
+        // Held by the solver thread while extending the tree, and by the
+        // main loop while updating a solution on it
+        pthread_mutex_t      m_tree_mutex;
+        
+        // Seconds from the start to the completion of each order, valid
+        // once the job is done
+        std::vector<double>  m_order_times;
+        
+    private:
+        
+        bool                 m_done;
+        int                  m_order;
+        pthread_mutex_t      m_mutex;
+        pthread_cond_t       m_cond;
+    };
+    
+    // Complete beam trees recently built or used, by their root position on
+    // a grid, for sources walking back to where they have been. A tree is
+    // reused for root positions within a grid step. The least recently used
+    // trees are released once the nodes take more than the memory limit
+    struct RecentTrees
+    {
+        RecentTrees ();
+        ~RecentTrees ();
+        
+        void setLimits ( size_t maxBytes, float gridSize );
+        bool isEnabled () const { return m_max_bytes > 0; }
+        bool isClose ( const EL::Vector3& a, const EL::Vector3& b ) const { return ( a - b ).length () <= m_grid_size; }
+        void insert ( EL::BeamTree *tree, bool reciprocal, bool speculative = false );
+        EL::BeamTree *find ( const EL::Room *room, const EL::Vector3& root, bool reciprocal );
+        bool contains ( const EL::Room *room, const EL::Vector3& root, bool reciprocal );
+        void clear ();
+        
+        int                  m_hits;
+        
+        // Speculative trees used, and dropped unused
+        int                  m_speculative_hits;
+        int                  m_speculative_misses;
+        
+    private:
+        
+        struct Key
+        {
+            int                  m_cell[3];
+            bool                 m_reciprocal;
+            bool operator< ( const Key& other ) const;
+        };
+        
+        struct Entry
+        {
+            Key                  m_key;
+            EL::BeamTree         *m_tree;
+            size_t               m_bytes;
+            bool                 m_speculative;
+        };
+        
+        Key  getKey ( const EL::Vector3& root, bool reciprocal ) const;
+        std::list<Entry>::iterator lookup ( const EL::Room *room, const EL::Vector3& root, bool reciprocal );
+        void remove ( std::list<Entry>::iterator entry );
+        
+        // Most recently used first
+        std::list<Entry>     m_entries;
+        std::map<Key, std::list<Entry>::iterator> m_index;
+        size_t               m_bytes;
+        size_t               m_max_bytes;
+        float                m_grid_size;
+    };
+    
+    // A change posted by the reader thread, applied by the main loop at the
+    // top of update(). Stamped with the time it was received. Sources and
+    // listeners are known by the handles the reader gave them, only a new
+    // one carries its name
+    struct Command
+    {
+        enum Type
+        {
+            GEOMETRY,
+            NEW_SOURCE,
+            NEW_LISTENER,
+            SOURCE_MAJOR,
+            SOURCE_MINOR,
+            LISTENER_MAJOR,
+            LISTENER_MINOR,
+            PREDICTION,
+            SOURCE_PRIORITY,
+            LISTENER_PRIORITY,
+            NUM_TYPES
+        };
+        
+        enum Type            m_type;
+        int                  m_handle;
+        EL::Vector3          m_position;
+        EL::Matrix3          m_orientation;
+        float                m_value;
+        std::string          *m_name;
+        std::vector<EL::Room::Element> *m_elements;
+        double               m_time;
+    };
+    
+    // Bounded lock-free queue of commands for any number of producers and a
+    // single consumer. Each cell carries a sequence number telling whether
+    // it is free for the producer of that turn or ready for the consumer
+    struct CommandQueue
+    {
+        CommandQueue ( int capacity );
+        ~CommandQueue ();
+        
+        // False when full, or when empty
+        bool push ( const Command& command );
+        bool pop ( Command& command );
+        
+    private:
+        
+        struct Cell
+        {
+            std::atomic<size_t>  m_sequence;
+            Command              m_command;
+        };
+        
+        Cell                 *m_cells;
+        size_t               m_mask;
+        
+        // On separate cache lines, the producers contend for the tail only
+        char                 m_padding0[64];
+        std::atomic<size_t>  m_tail;
+        char                 m_padding1[64];
+        size_t               m_head;
     };
     
     Solver (int mindepth, int maxdepth, bool graphics);
     ~Solver ();
     
-    inline void calculateNextSolution ()
-    {
-        m_next_solution->solve ();
-        printf ( "Solved!\n" );
-        //    m_next_solution->update ();
-        //    printf ( "Updated!\n" );
-        //    m_next_solution->update ();
-        pthread_mutex_lock (&next_solution_mutex);
-        m_next_solution_flag = true;
-        pthread_mutex_unlock (&next_solution_mutex);
-    }
+    inline void calculateNextSolution () { m_next_job->run ( this ); }
+    
+    // The main loop sleeps in waitForUpdate() until the reader, a completed
+    // order or the end of a calculation gives update() something to do, the
+    // path solver thread in waitForCalculation() until a calculation starts
+    void signalUpdate ();
+    void waitForUpdate ();
+    void waitForCalculation ();
     
     inline void attachReader ( Reader *re ) { m_reader = re; }
     inline void addWriter ( Writer *wr ) { m_writers.push_back(wr); }
     
+    // Root the beam trees at the listeners when there are fewer listeners
+    // than sources, the paths sent to the writers are the same
+    inline void setReciprocalMode ( bool enabled ) { m_reciprocal_mode = enabled; }
+    
+    // Threads validating the paths of a large solution on each update, one
+    // pool of them shared by all the solutions
+    void setUpdateThreads ( int threads );
+    
+    // Beam tree nodes allowed for each solution and for all of them, trees
+    // hitting the limit are truncated. Zero means no limit
+    inline void setNodeLimits ( int perSolution, int total ) { m_node_limit = perSolution; m_total_node_limit = total; }
+    
+    // Trees cut short by the node limits so far
+    inline int getTruncatedTrees () const { return m_truncated_trees; }
+    
+    // Build the beam trees shortest paths first, so that truncated or
+    // interrupted trees hold the loudest reflections
+    inline void setBestFirst ( bool enabled ) { m_best_first = enabled; }
+    
+    // Keep the complete beam trees in this directory and start from them
+    // when a source comes back to a cached position in the same room
+    void setTreeCache ( const char* directory );
+    
+    // Keep up to this many bytes of recently used beam trees in memory, by
+    // root position on a grid of this step (metres). Zero bytes disables
+    inline void setRecentTrees ( size_t maxBytes, float gridSize ) { m_recent_trees.setLimits ( maxBytes, gridSize ); }
+    
+    // Adjust the initial and maximum orders at run time so that a moved
+    // source gets the paths of the initial order, and a moved listener its
+    // updated paths, within this many milliseconds. Zero disables
+    inline void setLatencyTarget ( float milliseconds ) { m_latency_target = milliseconds; }
+    
+    // Speculative beam trees built while the solver is idle at the positions
+    // predicted by the reader, used when the source lands within a grid step
+    // of them. Needs the recent trees
+    inline int getPredictionHits () const { return m_recent_trees.m_speculative_hits; }
+    inline int getPredictionMisses () const { return m_recent_trees.m_speculative_misses; }
+    
+    // Source and listener updates superseded before the main loop got to them
+    inline long getDroppedUpdates () const { return m_dropped_updates; }
+    
     void readRoomDescription (const char* filename, MaterialFile& materials);
     
     void update ();
@@ -108,50 +356,144 @@ public:
     bool readyToDraw () { return m_ready_to_draw; };
     void cleanDrawFlag () { m_ready_to_draw = false; };
     
-    void markGeometryChanged  ();
-    void createNewSolutionNode ( const EL::Source& source, const EL::Listener& listener );
-    void markSourceMovementMajor   ( const EL::Source& source, const EL::Listener& listener );
-    void markSourceMovementMinor   ( const EL::Source& source, const EL::Listener& listener );
-    void markListenerMovementMajor ( const EL::Source& source, const EL::Listener& listener );
-    void markListenerMovementMinor ( const EL::Source& source, const EL::Listener& listener );
+    // Called from the reader thread, the changes are queued for the main loop.
+    // The reader numbers its sources and listeners from zero as it first
+    // sees them, each new one gets a solution node with all the others
+    void markGeometryChanged  ( const std::vector<EL::Room::Element>& elements );
+    void addSource            ( int source, const EL::Source& object );
+    void addListener          ( int listener, const EL::Listener& object );
+    void markSourceMovementMajor   ( int source, const EL::Vector3& position );
+    void markSourceMovementMinor   ( int source, const EL::Matrix3& orientation );
+    void markListenerMovementMajor ( int listener, const EL::Vector3& position, const EL::Matrix3& orientation );
+    void markListenerMovementMinor ( int listener, const EL::Matrix3& orientation );
+    void predictSourceMovement     ( int source, const EL::Vector3& position );
+    
+    // Scale the audibility the solve jobs of the pairs of a source or a
+    // listener are ranked by, 1 by default
+    void setSourcePriority    ( int source, float priority );
+    void setListenerPriority  ( int listener, float priority );
     
     
 private:
     
-    void createNewSolution    ( int depth, const EL::Source &source, const EL::Listener& listener );
+    void createNewSolution    ( int depth, struct SolutionNode *node, bool progressive );
+    void createSpeculativeSolution ( struct SolutionNode *node );
+    bool isPredictedSolution  ( struct SolutionNode *node );
+    void addSolutionToJob     ( struct SolutionNode *node );
+    bool shareBeamTree        ( struct SolutionNode *node );
+    void useBeamTree          ( struct SolutionNode *node, EL::BeamTree *tree );
+    void snapToRoot           ( struct SolutionNode *node, const EL::Vector3& root );
+    void prepareNextSolution  ( struct SolutionNode *node );
+    void takeSolutionIntoUse  ( struct SolutionNode *node, EL::PathSolution *solution );
+    const EL::Vector3& getRootPosition   ( struct SolutionNode *node );
+    const EL::Vector3& getTargetPosition ( struct SolutionNode *node );
+    void updateRootSide       ();
+    int  getNodeLimit         ( struct SolutionNode *node );
+    void recordLatency        ( struct SolutionNode *node );
+    void tuneInitialOrder     ( SolveJob *job );
+    void tuneMaximumOrder     ();
+    void restoreRoomOrders    ();
+    void reportLatency        ();
+    void postCommand          ( Command& command, enum Command::Type type, int handle );
+    void applyCommands        ();
+    void applyGeometryChange  ( std::vector<EL::Room::Element>& elements, double time );
+    void applyNewSource       ( int source, const Command& command );
+    void applyNewListener     ( int listener, const Command& command );
+    void createNewSolutionNode ( int source, int listener, double time );
+    void applySourceMovementMajor   ( struct SolutionNode *node, const EL::Vector3& position, double time );
+    void applySourceMovementMinor   ( struct SolutionNode *node, const EL::Matrix3& orientation );
+    void applyListenerMovementMajor ( struct SolutionNode *node, const EL::Vector3& position, const EL::Matrix3& orientation, double time );
+    void applyListenerMovementMinor ( struct SolutionNode *node, const EL::Matrix3& orientation );
+    void applySourceMovementPrediction ( struct SolutionNode *node, const EL::Vector3& position );
+    void sortByPriority       ( std::vector<struct SolutionNode *>& nodes );
+    void signalCalculation    ();
     void interruptCalculation ();
-    
-    void mapAvailableSolutionNodes ();
+    void finishCalculation    ();
     
     int  m_min_depth;
     int  m_max_depth;
-    bool m_next_solution_flag;
     bool m_request_for_stop;
-    bool m_start_new;
+    bool m_reciprocal_mode;
+    bool m_reciprocal;
+    int  m_update_threads;
+    EL::UpdatePool *m_update_pool;
+    int  m_node_limit;
+    int  m_total_node_limit;
+    int  m_truncated_trees;
+    bool m_best_first;
+    EL::BeamTreeCache *m_tree_cache;
+    RecentTrees m_recent_trees;
+    int  m_recent_trees_room;
+    
+    // Latency target (ms), the growth of the solve time per order, the last
+    // update time, the latencies last measured for each initial order in this
+    // room, the smoothed update times of each order with their updates in a
+    // row over the target and the time they were last measured, and the
+    // orders tuned for each room by hash
+    float m_latency_target;
+    float m_order_growth;
+    float m_last_update_time;
+    std::vector<float> m_initial_latencies;
+    std::vector<float> m_update_latencies;
+    std::vector<int>   m_update_misses;
+    std::vector<double> m_update_stamps;
+    int   m_tuned_room;
+    unsigned long long m_tuned_room_hash;
+    std::map<unsigned long long, std::pair<int, int> > m_room_orders;
     bool m_graphics;
     bool m_ready_to_draw;
     
+    // Version of the geometry, counting the changes
     int m_current_room;
+    // No geometry received yet
     bool isLoadingNewRoom;
     
     // "Doublebuffering" for the data structures
-    EL::Room m_room[20];
-    EL::PathSolution *m_next_solution;
+    // The current room, a shared snapshot the beam trees built on it keep
+    // alive after a geometry change until they are released
+    EL::RoomSnapshot *m_room;
+    SolveJob *m_next_job;
+    
+    pthread_mutex_t m_signal_mutex;
+    pthread_cond_t  m_update_cond;
+    pthread_cond_t  m_calculate_cond;
+    bool m_calculate_signal;
+    
+    // Set without the lock, which is only taken to wake the main loop
+    // when it sleeps in waitForUpdate()
+    std::atomic<bool> m_update_signal;
+    std::atomic<bool> m_update_sleeping;
+    
+    // Changes from the reader, and the count of drains of a full queue
+    // the reader waits for
+    CommandQueue m_commands;
+    pthread_cond_t m_drain_cond;
+    std::atomic<unsigned> m_drains;
+    
+    // The commands of this update pass, the latest of each kind for each
+    // source and listener, and the tracker updates dropped for a later one
+    // in this pass and so far. The buffers are kept from pass to pass
+    std::vector<Command> m_pending_commands;
+    std::vector<int> m_latest_commands;
+    std::vector<bool> m_dropped_commands;
+    long m_dropped_updates;
     
     pthread_t graphics_thread;
     
     pthread_t path_solver_thread;
-    pthread_mutex_t next_solution_mutex;
-    
-    struct SolutionNode m_solutionNodes[MAX_NUM_SOLUTIONS];
-    int m_lastMappedSolutionNode;
-    int m_lastAvailableSolutionNode;
-    bool m_newSolutionNodesAvailable;
     
-    typedef std::map<std::string, struct SolutionNode *> t_solutionNodeMap;
-    typedef t_solutionNodeMap::iterator t_solutionNodeIterator;
+    // The pairs with writers in creation order, and by source and listener
+    // handle in a table grown as new ones come (null for the pairs without
+    // writers). The sources and listeners by handle, as last seen
+    typedef std::vector<struct SolutionNode *> t_solutionNodeList;
+    typedef t_solutionNodeList::iterator t_solutionNodeIterator;
     
-    t_solutionNodeMap m_solutionNodeMap;
+    t_solutionNodeList m_solutionNodes;
+    std::vector<t_solutionNodeList> m_pairs;
+    std::vector<EL::Source> m_sources;
+    std::vector<EL::Listener> m_listeners;
+    std::vector<float> m_source_priorities;
+    std::vector<float> m_listener_priorities;
     
     std::vector<Writer *> m_writers;
     Reader *m_reader;
@@ -64,11 +64,47 @@ void Writer::parseOrder(char *s)
     
 }
 
+SolutionSnapshot::SolutionSnapshot (EL::PathSolution *solution, int sourceHandle, int listenerHandle, bool withPaths):
+m_source(solution->getSource()),
+m_listener(solution->getListener()),
+m_sourceHandle(sourceHandle),
+m_listenerHandle(listenerHandle),
+m_references(0)
+{
+    if( !withPaths ){ return; }
+    
+    m_paths.resize(solution->numPaths());
+    for( int i = 0; i < solution->numPaths(); i++ )
+    {
+        const EL::PathSolution::Path path = solution->getPath(i);
+        PathEntry& e = m_paths[i];
+        e.m_key = solution->getPathKey(i);
+        e.m_order = path.m_order;
+        e.m_firstPoint = m_points.size();
+        e.m_length = solution->getLength(path);
+        m_points.insert(m_points.end(), path.m_points, path.m_points + path.numPoints());
+        
+        for( int k = 0; k < 10; k++ ){ e.m_reflectance[k] = 1.0; }
+        for( int j = 0; j < path.m_order; j++ )
+        {
+            const Material& m = path.m_polygons[j]->getMaterial();
+            for( int k = 0; k < 10; k++ ){ e.m_reflectance[k] *= ( 1 - m.absorption[k] ); }
+        }
+    }
+}
+
 Writer::Writer (char *addr):
+m_socket(0),
 m_minOrder(0),
 m_maxOrder(1024 * 1024),
-m_maxAmount(1024 * 1024)
+m_maxAmount(1024 * 1024),
+m_running(false),
+m_stopping(false),
+m_droppedMessages(0)
 {
+    pthread_mutex_init(&m_queueMutex, NULL);
+    pthread_cond_init(&m_queueCond, NULL);
+    
     char *s = strchr(addr, '/');
     
     if( s )
@@ -119,40 +155,170 @@ void Writer::connect ()
     if( m_socket ){ std::cout << "New writer socket opened." << std::endl; }
 }
 
-void Writer::disconnect () { delete m_socket; }
+Writer::~Writer ()
+{
+    EL_ASSERT(!m_running);
+    
+    // Messages of a writer never started
+    while( !m_queue.empty() ){ dropMessage(m_queue.begin()); }
+    disconnect();
+    pthread_cond_destroy(&m_queueCond);
+    pthread_mutex_destroy(&m_queueMutex);
+}
+
+void Writer::disconnect () { delete m_socket; m_socket = 0; }
 
-AuralizationWriter::AuralizationWriter (char *addr):
-Writer(addr)
+static void *output_loop (void *data)
 {
-    OSC_initBuffer(&m_oscbuf, BUF_SIZE, m_writeBuf);
-    OSC_resetBuffer(&m_oscbuf);
+    ((Writer *)data)->runOutput();
+    return NULL;
+}
+
+void Writer::start ()
+{
+    if( m_running ){ return; }
+    m_stopping = false;
+    m_running = ( pthread_create(&m_thread, NULL, output_loop, this) == 0 );
+    if( !m_running ){ cout << "Could not start the output thread of the " << getType() << " writer." << endl; }
 }
 
-std::string AuralizationWriter::getPathName(const EL::PathSolution::Path& p)
+void Writer::stop ()
 {
-    std::string pathName;
+    if( !m_running ){ return; }
     
-    if (p.m_order > 0)
+    pthread_mutex_lock(&m_queueMutex);
+    m_stopping = true;
+    pthread_cond_signal(&m_queueCond);
+    pthread_mutex_unlock(&m_queueMutex);
+    
+    pthread_join(m_thread, NULL);
+    m_running = false;
+}
+
+void Writer::runOutput ()
+{
+    pthread_mutex_lock(&m_queueMutex);
+    while( 1 )
     {
-        for (int i=0; i < p.m_order ; i++)
+        while( m_queue.empty() && !m_stopping ){ pthread_cond_wait(&m_queueCond, &m_queueMutex); }
+        if( m_queue.empty() ){ break; }
+        
+        Message message = m_queue.front();
+        m_queue.pop_front();
+        pthread_mutex_unlock(&m_queueMutex);
+        
+        // Written without the lock, the solver loop keeps posting meanwhile
+        switch( message.m_type )
         {
-            pathName.append( p.m_polygons[i]->getName() );
+            case MAJOR:
+                writeMajor(*message.m_snapshot);
+                break;
+            case MINOR:
+                writeMinor(*message.m_snapshot, message.m_listSrcOrBoth);
+                break;
+            case LATENCY:
+                writeLatency(message.m_initialOrder, message.m_maximumOrder, message.m_latency, message.m_update, message.m_target);
+                break;
         }
+        if( message.m_snapshot ){ message.m_snapshot->removeReference(); }
+        
+        pthread_mutex_lock(&m_queueMutex);
     }
-    else{ pathName.append("dir"); }
-    
-    return pathName;
-}  
+    pthread_mutex_unlock(&m_queueMutex);
+}
 
-int AuralizationWriter::getPathIDandState(const EL::PathSolution::Path& p, enum PathState& state)
+void Writer::dropMessage (std::deque<Message>::iterator it)
 {
-    std::string pathName = getPathName(p);
+    if( it->m_snapshot ){ it->m_snapshot->removeReference(); }
+    m_queue.erase(it);
+    m_droppedMessages++;
+}
+
+void Writer::post (Message& message)
+{
+    if( message.m_snapshot ){ message.m_snapshot->addReference(); }
     
-    //  std::cout << "Path name = " << pathName << std::endl;
+    pthread_mutex_lock(&m_queueMutex);
     
-    state = m_pathMap[pathName].m_state;
+    // Latest wins: the queued message this one supersedes is dropped, the
+    // new one goes to the back so that the messages of a pair stay in order
+    for( std::deque<Message>::iterator it = m_queue.begin(); it != m_queue.end(); )
+    {
+        bool superseded = false;
+        if( message.m_type == LATENCY ){ superseded = ( it->m_type == LATENCY ); }
+        else if( it->m_type != LATENCY && it->m_snapshot->isSamePair(*message.m_snapshot) )
+        {
+            // Path messages carry the orientations too
+            if( message.m_type == MAJOR ){ superseded = true; }
+            else if( it->m_type == MINOR )
+            {
+                superseded = true;
+                if( it->m_listSrcOrBoth != message.m_listSrcOrBoth ){ message.m_listSrcOrBoth = 2; }
+            }
+        }
+        
+        if( superseded )
+        {
+            size_t offset = it - m_queue.begin();
+            dropMessage(it);
+            it = m_queue.begin() + offset;
+        }
+        else { it++; }
+    }
     
-    return m_pathMap[pathName].m_id;
+    if( m_queue.size() >= WRITER_QUEUE_SIZE ){ dropMessage(m_queue.begin()); }
+    m_queue.push_back(message);
+    
+    pthread_cond_signal(&m_queueCond);
+    pthread_mutex_unlock(&m_queueMutex);
+}
+
+void Writer::postMajor (SolutionSnapshot *snapshot)
+{
+    Message message;
+    message.m_type = MAJOR;
+    message.m_snapshot = snapshot;
+    post(message);
+}
+
+void Writer::postMinor (SolutionSnapshot *snapshot, int listSrcOrBoth)
+{
+    Message message;
+    message.m_type = MINOR;
+    message.m_snapshot = snapshot;
+    message.m_listSrcOrBoth = listSrcOrBoth;
+    post(message);
+}
+
+void Writer::postLatency (int initialOrder, int maximumOrder, float latency, float update, float target)
+{
+    Message message;
+    message.m_type = LATENCY;
+    message.m_snapshot = 0;
+    message.m_initialOrder = initialOrder;
+    message.m_maximumOrder = maximumOrder;
+    message.m_latency = latency;
+    message.m_update = update;
+    message.m_target = target;
+    post(message);
+}
+
+int Writer::getQueueDepth ()
+{
+    pthread_mutex_lock(&m_queueMutex);
+    int depth = m_queue.size();
+    pthread_mutex_unlock(&m_queueMutex);
+    return depth;
+}
+
+AuralizationWriter::AuralizationWriter (char *addr):
+Writer(addr),
+m_numSent(0),
+m_pass(0),
+m_nextID(0)
+{
+    OSC_initBuffer(&m_oscbuf, BUF_SIZE, m_writeBuf);
+    OSC_resetBuffer(&m_oscbuf);
 }
 
 #define OSC_SAFE(OPERATION) if (OSC_freeSpaceInBuffer(&m_oscbuf) <= 4) cout << "OSC buffer full. Please increase!" << endl; else OPERATION
@@ -267,7 +433,6 @@ void AuralizationWriter::createInvisMessage( int pathID )
 
 int AuralizationWriter::getNewID()
 {
-    static int s_next = 0;
     int id;
     
     if ( !m_releaved.empty () )
@@ -277,77 +442,87 @@ int AuralizationWriter::getNewID()
     }
     else
     {
-        id = s_next;
-        s_next++;
+        id = m_nextID;
+        m_nextID++;
     }
     return id;
 }
 
-void  AuralizationWriter::markExistingPaths (EL::PathSolution *solution)
+void AuralizationWriter::releaveRemovedPaths (t_sentPaths& sent)
 {
-    string pathName;
-    
-    for (map<std::string, struct PathNode>::iterator it = m_pathMap.begin();
-         it != m_pathMap.end(); it++)
+    for (t_sentPaths::iterator it = sent.begin(); it != sent.end(); )
     {
-        it->second.m_state = FADE_OUT;
-    }
-    
-    int pathCount = 0;
-    for (int i=0; i < solution->numPaths(); i++)
-    {
-        const EL::PathSolution::Path& path = solution->getPath(i);
+        if ( it->second.m_pass == m_pass ){ it++; continue; }
         
-        if( pathCount >= m_maxAmount ){ break; }
-        if( (path.m_order < m_minOrder) || (path.m_order > m_maxOrder)){ continue; }
-        
-        pathCount++;
-        
-        pathName = getPathName ( path );
-        
-        map<std::string, struct PathNode>::iterator it = m_pathMap.find ( pathName );
-        if ( it == m_pathMap.end() )
-        {
-            m_pathMap[pathName].m_state = FADE_IN;
-            m_pathMap[pathName].m_id = getNewID ();
-        }
-        else{ m_pathMap[pathName].m_state = UPDATE; }
+        createInvisMessage ( it->second.m_id );
+        m_releaved.push_back ( it->second.m_id );
+        sent.erase ( it++ );
+        m_numSent--;
     }
 }
 
-void AuralizationWriter::releaveLeftOverPaths()
+void AuralizationWriter::writePath (t_sentPaths& sent, const SolutionSnapshot& snapshot, int pathIndex)
 {
-    for (map<std::string, struct PathNode>::iterator it = m_pathMap.begin();
-         it != m_pathMap.end(); it++)
+    const SolutionSnapshot::PathEntry& path = snapshot.getPath(pathIndex);
+    if( (path.m_order < m_minOrder) || (path.m_order > m_maxOrder) ){ return; }
+    
+    const EL::Vector3* points = snapshot.getPoints(pathIndex);
+    const EL::Vector3& p0 = points[1];
+    const EL::Vector3& pN = points[path.numPoints () - 2];
+    
+    enum PathState state = UPDATE;
+    t_sentPaths::iterator it = sent.find ( path.m_key );
+    if ( it == sent.end() )
     {
-        if ( it->second.m_state == FADE_OUT )
-        {
-            createInvisMessage ( it->second.m_id );
-            m_releaved.push_back ( it->second.m_id );
-            m_pathMap.erase ( it );
-        }
+        // New path, or one left out so far by the amount limit
+        if( m_numSent >= m_maxAmount ){ return; }
+        SentPath s;
+        s.m_id = getNewID ();
+        s.m_pass = m_pass;
+        it = sent.insert ( make_pair(path.m_key, s) ).first;
+        m_numSent++;
+        state = FADE_IN;
+    }
+    else if ( it->second.m_p0 == p0 && it->second.m_pN == pN && it->second.m_length == path.m_length )
+    {
+        // Only the paths that changed since they were last sent
+        return;
     }
+    it->second.m_p0 = p0;
+    it->second.m_pN = pN;
+    it->second.m_length = path.m_length;
+    
+    float reflectance[10];
+    for( int k = 0; k < 10; k++ ){ reflectance[k] = path.m_reflectance[k]; }
+    
+    createReflectionMessage(it->second.m_id, state, p0, pN, path.m_length, path.m_order, reflectance);
+    m_socket->write(OSC_packetSize(&m_oscbuf), OSC_getPacket(&m_oscbuf));
+    OSC_resetBuffer(&m_oscbuf);
 }
 
-void AuralizationWriter::writeMajor(EL::PathSolution *solution)
+void AuralizationWriter::writeMajor(const SolutionSnapshot& snapshot)
 {
-    int pathID;
-    float len;
-    enum PathState state;
-    float reflectance[10];
-    const EL::Source& source = solution->getSource();
-    const EL::Listener& listener = solution->getListener();
+    const EL::Source& source = snapshot.getSource();
+    const EL::Listener& listener = snapshot.getListener();
+    t_sentPaths& sent = m_sentPaths[ make_pair(snapshot.getSourceHandle(), snapshot.getListenerHandle()) ];
     OSCTimeTag tt;
     int error;
     
+    // The paths sent before and no longer in the snapshot are taken out
+    m_pass++;
+    for (int i=0; i < snapshot.numPaths(); i++)
+    {
+        t_sentPaths::iterator it = sent.find ( snapshot.getPath(i).m_key );
+        if ( it != sent.end() ){ it->second.m_pass = m_pass; }
+    }
+    
     error = OSC_openBundle(&m_oscbuf, tt);
     if( error ){ printf("OSC error: %s\n", OSC_errorMessage); }
     
     createSourceMessage ( source );
     createListenerMessage ( listener );
     
-    markExistingPaths ( solution );
-    releaveLeftOverPaths ();
+    releaveRemovedPaths ( sent );
     
     error = OSC_closeBundle(&m_oscbuf);
     if( error ){ printf("OSC error: %s\n", OSC_errorMessage); }
@@ -355,34 +530,7 @@ void AuralizationWriter::writeMajor(EL::PathSolution *solution)
     m_socket->write(OSC_packetSize(&m_oscbuf), OSC_getPacket(&m_oscbuf));
     OSC_resetBuffer(&m_oscbuf);
     
-    int pathCount = 0;
-    for (int i=0; i < solution->numPaths (); i++)
-    {
-        const EL::PathSolution::Path& path = solution->getPath(i);
-        
-        if( pathCount >= m_maxAmount ){ break; }
-        if( (path.m_order < m_minOrder) || (path.m_order > m_maxOrder) ){ continue; }
-        pathCount++;
-        
-        pathID = getPathIDandState ( path, state );
-        len = solution->getLength (path);
-        
-        const EL::Vector3& p0 = path.m_points[1];
-        const EL::Vector3& pN = path.m_points[path.m_points.size () - 2];
-        
-        for( int k = 0; k < 10; k++ ){ reflectance[k] = 1.0; }
-        
-        for( int j = 0; j < path.m_order; j++ )
-        {
-            const EL::Polygon* p = path.m_polygons[j];
-            const Material& m = p->getMaterial ();
-            for( int k = 0; k < 10; k++ ){ reflectance[k] *= ( 1 - m.absorption[k] ); }
-        }
-        
-        createReflectionMessage(pathID, state, p0, pN, len, path.m_order, reflectance);
-        m_socket->write(OSC_packetSize(&m_oscbuf), OSC_getPacket(&m_oscbuf));
-        OSC_resetBuffer(&m_oscbuf);
-    }
+    for (int i=0; i < snapshot.numPaths(); i++){ writePath ( sent, snapshot, i ); }
     
     
 // DISCARDED: RT60 sent by Blender add-on for now
@@ -414,10 +562,10 @@ void AuralizationWriter::writeMajor(EL::PathSolution *solution)
 //    OSC_resetBuffer(&m_oscbuf);
 }
 
-void AuralizationWriter::writeMinor(EL::PathSolution *solution, int listSrcOrBoth)
+void AuralizationWriter::writeMinor(const SolutionSnapshot& snapshot, int listSrcOrBoth)
 {
-    const EL::Listener& listener = solution->getListener();
-    const EL::Source& source = solution->getSource();
+    const EL::Listener& listener = snapshot.getListener();
+    const EL::Source& source = snapshot.getSource();
     OSCTimeTag tt;
     int error;
     
@@ -442,17 +590,31 @@ void AuralizationWriter::writeMinor(EL::PathSolution *solution, int listSrcOrBot
     OSC_resetBuffer(&m_oscbuf);
 }
 
+void AuralizationWriter::writeLatency(int initialOrder, int maximumOrder, float latency, float update, float target)
+{
+    OSC_SAFE(OSC_writeAddressAndTypes(&m_oscbuf, "/latency", ",iifff");)
+    OSC_SAFE(OSC_writeIntArg(&m_oscbuf, initialOrder);)
+    OSC_SAFE(OSC_writeIntArg(&m_oscbuf, maximumOrder);)
+    OSC_SAFE(OSC_writeFloatArg(&m_oscbuf, latency);)
+    OSC_SAFE(OSC_writeFloatArg(&m_oscbuf, update);)
+    OSC_SAFE(OSC_writeFloatArg(&m_oscbuf, target);)
+    
+    m_socket->write(OSC_packetSize(&m_oscbuf), OSC_getPacket(&m_oscbuf));
+    OSC_resetBuffer(&m_oscbuf);
+}
+
 #define ABS(x) ((x)>0 ? (x) : (-(x)))
 
-void VisualizationWriter::writeMajor(EL::PathSolution *solution)
+void VisualizationWriter::writeMajor(const SolutionSnapshot& snapshot)
 {
     int numLines = 1;
     bool interesting;
     int pathCount = 0;
     
-    for( int i=0; i < solution->numPaths(); i++ )
+    for( int i=0; i < snapshot.numPaths(); i++ )
     {
-        const EL::PathSolution::Path& path = solution->getPath(i);
+        const SolutionSnapshot::PathEntry& path = snapshot.getPath(i);
+        const EL::Vector3* points = snapshot.getPoints(i);
         
         if( pathCount >= m_maxAmount ){ break; }
         if( (path.m_order < m_minOrder) || (path.m_order > m_maxOrder) ){ continue; }
@@ -462,10 +624,10 @@ void VisualizationWriter::writeMajor(EL::PathSolution *solution)
         
         if( interesting )
         {
-            for( int j=0; j < path.m_points.size()-1; j++ )
+            for( int j=0; j < path.numPoints()-1; j++ )
             {
-                const EL::Vector3& p0 = path.m_points[j];
-                const EL::Vector3& p1 = path.m_points[j+1];
+                const EL::Vector3& p0 = points[j];
+                const EL::Vector3& p1 = points[j+1];
                 sprintf(m_writeBuf, "/line_on %d %f %f %f %f %f %f", numLines++, p0[0], p0[1], p0[2],
                         p1[0], p1[1], p1[2]);
                 m_socket->write(strlen(m_writeBuf), m_writeBuf);
@@ -482,9 +644,9 @@ void VisualizationWriter::writeMajor(EL::PathSolution *solution)
     m_numLines = numLines;
 }
 
-void VisualizationWriter::writeMinor(EL::PathSolution *solution, int listSrcOrBoth) {}
+void VisualizationWriter::writeMinor(const SolutionSnapshot&, int) {}
 
-void PrintWriter::writeMajor(EL::PathSolution *solution)
+void PrintWriter::writeMajor(const SolutionSnapshot&)
 {
 //  int numLines = 0;
 //  ReverbEstimator r(SAMPLE_RATE, solution, SPEED_OF_SOUND, MAX_RESPONSE_TIME);
@@ -505,4 +667,4 @@ void PrintWriter::writeMajor(EL::PathSolution *solution)
 
 }
 
-void PrintWriter::writeMinor(EL::PathSolution *solution, int listSrcOrBoth) {}
+void PrintWriter::writeMinor(const SolutionSnapshot&, int) {}
@@ -36,22 +36,84 @@
 #define _WRITER_H
 
 #include <map>
+#include <deque>
+#include <atomic>
 #include <cstring>
 #include <regex.h>
+#include <pthread.h>
 
 #include "elPathSolution.h"
+#include "elSource.h"
+#include "elListener.h"
 #include "OSC-client.h"
 #include "socket.h"
 
 #define BUF_SIZE 16384
 
+// Messages a writer may have queued for its output thread. A pair has at
+// most one path and one orientation message queued, so the oldest message
+// is only dropped for more pairs than that
+#define WRITER_QUEUE_SIZE 1024
+
+// The paths of a solution as the writers see them, copied on the solver
+// loop so that the output threads never read a solution being updated. A
+// snapshot is shared by the writers of the pair and deleted with the last
+// reference
+class SolutionSnapshot
+{
+    
+public:
+    
+    struct PathEntry
+    {
+        EL::PathSolution::PathKey m_key;
+        int   m_order;
+        int   m_firstPoint;
+        float m_length;
+        float m_reflectance[10];
+        
+        int numPoints (void) const { return m_order+2; }
+    };
+    
+    // The paths are left out of the snapshots for orientation changes
+    SolutionSnapshot (EL::PathSolution *solution, int sourceHandle, int listenerHandle, bool withPaths);
+    
+    void addReference (void) const { m_references++; }
+    void removeReference (void) const { if( --m_references == 0 ){ delete this; } }
+    
+    bool isSamePair (const SolutionSnapshot& other) const { return m_sourceHandle == other.m_sourceHandle && m_listenerHandle == other.m_listenerHandle; }
+    int getSourceHandle (void) const { return m_sourceHandle; }
+    int getListenerHandle (void) const { return m_listenerHandle; }
+    
+    const EL::Source& getSource (void) const { return m_source; }
+    const EL::Listener& getListener (void) const { return m_listener; }
+    
+    int numPaths (void) const { return m_paths.size(); }
+    const PathEntry& getPath (int i) const { return m_paths[i]; }
+    const EL::Vector3* getPoints (int i) const { return &m_points[m_paths[i].m_firstPoint]; }
+    
+    
+private:
+    
+    EL::Source   m_source;
+    EL::Listener m_listener;
+    int m_sourceHandle;
+    int m_listenerHandle;
+    
+    std::vector<PathEntry>   m_paths;
+    std::vector<EL::Vector3> m_points;
+    mutable std::atomic<int> m_references;
+};
+
 class Writer
 {
     
 public:
     
+    // Call stop() before deleting a started writer, the output thread
+    // calls the virtual methods of the derived class
     Writer (char *addr);
-    ~Writer () { disconnect(); };
+    virtual ~Writer ();
     
     void parseOrder(char *s);
     bool match ( const char* id );
@@ -59,9 +121,29 @@ public:
     void connect ();
     void disconnect ();
     
+    // The output thread writes the queued messages, stop() returns once
+    // the messages queued so far are written
+    void start ();
+    void stop ();
+    void runOutput ();
+    
+    // Queue the messages of the solver loop, which never waits for the
+    // output. A message replaces the queued one of the same kind for the
+    // same pair (latest wins), a path message also an orientation message
+    void postMajor (SolutionSnapshot *snapshot);
+    void postMinor (SolutionSnapshot *snapshot, int listSrcOrBoth);
+    void postLatency (int initialOrder, int maximumOrder, float latency, float update, float target);
+    
+    // Messages waiting for the output thread, and replaced or dropped so far
+    int getQueueDepth ();
+    int getDroppedMessages () const { return m_droppedMessages; }
+    
     virtual const char* getType() { return "Base"; };
-    virtual void writeMajor (EL::PathSolution *solution) { return; };
-    virtual void writeMinor (EL::PathSolution *solution, int listSrcOrBoth) { return; };
+    virtual void writeMajor (const SolutionSnapshot&) { return; };
+    virtual void writeMinor (const SolutionSnapshot&, int) { return; };
+    
+    // Orders chosen for the latency target and the times measured (ms)
+    virtual void writeLatency (int, int, float, float, float) { return; };
     
     
 protected:
@@ -76,9 +158,39 @@ protected:
     
 private:
     
+    enum MessageType
+    {
+        MAJOR,
+        MINOR,
+        LATENCY
+    };
+    
+    struct Message
+    {
+        enum MessageType  m_type;
+        SolutionSnapshot *m_snapshot;
+        int               m_listSrcOrBoth;
+        int               m_initialOrder;
+        int               m_maximumOrder;
+        float             m_latency;
+        float             m_update;
+        float             m_target;
+    };
+    
+    void post (Message& message);
+    void dropMessage (std::deque<Message>::iterator it);
+    
     char *m_host;
     char *m_pattern;
     regex_t m_preq;
+    
+    std::deque<Message> m_queue;
+    pthread_mutex_t m_queueMutex;
+    pthread_cond_t  m_queueCond;
+    pthread_t m_thread;
+    bool m_running;
+    bool m_stopping;
+    std::atomic<int> m_droppedMessages;
 };
 
 class AuralizationWriter : public Writer
@@ -89,8 +201,9 @@ public:
     AuralizationWriter (char *host);
     
     virtual const char* getType() { return "Auralization"; };
-    void writeMajor (EL::PathSolution *solution);
-    void writeMinor (EL::PathSolution *solution, int listSrcOrBoth);
+    void writeMajor (const SolutionSnapshot& snapshot);
+    void writeMinor (const SolutionSnapshot& snapshot, int listSrcOrBoth);
+    void writeLatency (int initialOrder, int maximumOrder, float latency, float update, float target);
     
     
 private:
@@ -98,13 +211,21 @@ private:
     enum PathState
     {
         FADE_IN,
-        UPDATE,
-        FADE_OUT
+        UPDATE
+    };
+    
+    // OSC path ID of a path sent, and where the path was sent from and to
+    struct SentPath
+    {
+        int         m_id;
+        EL::Vector3 m_p0;
+        EL::Vector3 m_pN;
+        float       m_length;
+        unsigned    m_pass;
     };
     
-    std::string    getPathName              ( const EL::PathSolution::Path& p );
-    int            getPathIDandState        ( const EL::PathSolution::Path& p, enum PathState& state );
-    float          getPathLength            ( const EL::PathSolution::Path& p );
+    typedef std::map<EL::PathSolution::PathKey, SentPath> t_sentPaths;
+    
     int            getNewID                 ( );
     
     void           createSourceMessage      ( const EL::Source& source );
@@ -118,18 +239,18 @@ private:
                                              float *reflectance );
     void           createInvisMessage       ( int pathID );
     
-    void           markExistingPaths        ( EL::PathSolution *solution );
-    void           releaveLeftOverPaths     ( );
+    void           writePath                ( t_sentPaths& sent, const SolutionSnapshot& snapshot, int pathIndex );
+    void           releaveRemovedPaths      ( t_sentPaths& sent );
     
     OSCbuf m_oscbuf;
     
-    struct PathNode
-    {
-        PathState    m_state;
-        int          m_id;
-    };
-    
-    std::map<std::string, struct PathNode> m_pathMap;
+    // The paths sent so far by source and listener handle. Snapshots may
+    // be dropped, so the paths to add, update and remove are found against
+    // the paths sent by their keys
+    std::map<std::pair<int, int>, t_sentPaths> m_sentPaths;
+    int m_numSent;
+    unsigned m_pass;
+    int m_nextID;
     std::vector<int> m_releaved;
 };
 
@@ -141,8 +262,8 @@ public:
     VisualizationWriter (char *host): Writer(host), m_numLines(0) {};
     
     virtual const char* getType() { return "VirChor"; };
-    void writeMajor (EL::PathSolution *solution);
-    void writeMinor (EL::PathSolution *solution, int listSrcOrBoth);
+    void writeMajor (const SolutionSnapshot& snapshot);
+    void writeMinor (const SolutionSnapshot& snapshot, int listSrcOrBoth);
     
     
 private:
@@ -159,8 +280,8 @@ public:
     PrintWriter (char *addr): Writer(addr) {};
     
     virtual const char* getType() { return "Print"; };
-    void writeMajor (EL::PathSolution *solution);
-    void writeMinor (EL::PathSolution *solution, int listSrcOrBoth);
+    void writeMajor (const SolutionSnapshot& snapshot);
+    void writeMinor (const SolutionSnapshot& snapshot, int listSrcOrBoth);
 };
 
 #endif
@@ -32,6 +32,7 @@
  ************************************************************************/
  
  
+#include <atomic>
 #include <string.h>
 #include "elBSP.h"
 #include "elBeam.h"
@@ -296,10 +297,13 @@ namespace
         float dEnter;
         float dExit;
     };
-    RecursionEntry*	g_recursionStack = 0;
-    int g_recursionStackSize = 0;
+    // Ray casts may run on several threads at once, each has its own stack
+    // deep enough for the deepest hierarchy constructed. Hierarchies may be
+    // constructed while other threads cast rays, hence the atomic depth
+    thread_local std::vector<RecursionEntry> g_recursionStack;
+    std::atomic<int> g_recursionStackSize(0);
     
-    Vector3 g_intersectionPoint;
+    thread_local Vector3 g_intersectionPoint;
 };
 
 //------------------------------------------------------------------------
@@ -511,13 +515,9 @@ void BSP::constructHierarchy(const Polygon** polygons, int numPolygons)
     delete m_hierarchy;
     m_hierarchy = 0;
     
-    // setup recursion stack
-    if( g_maxDepth > g_recursionStackSize )
-    {
-        g_recursionStackSize = g_maxDepth;
-        delete[] g_recursionStack;
-        g_recursionStack = new RecursionEntry[g_maxDepth];
-    }
+    // setup recursion stack, allocated by each thread on its first ray cast
+    int size = g_recursionStackSize.load();
+    while( g_maxDepth > size && !g_recursionStackSize.compare_exchange_weak(size, g_maxDepth) ){}
 }
 
 //------------------------------------------------------------------------
@@ -526,11 +526,11 @@ void BSP::constructHierarchy(const Polygon** polygons, int numPolygons)
 
 namespace
 {
-	Vector3 g_orig;
-	Vector3 g_dest;
-	Vector3 g_dir;
-	Vector3 g_invdir;
-	unsigned int g_dirsgn[3];
+	thread_local Vector3 g_orig;
+	thread_local Vector3 g_dest;
+	thread_local Vector3 g_dir;
+	thread_local Vector3 g_invdir;
+	thread_local unsigned int g_dirsgn[3];
 	std::set<const Polygon*> g_foundPolygons;
 
 	Vector3 g_beamMid;
@@ -539,17 +539,26 @@ namespace
 	std::vector<const Polygon*>* g_beamResult;
 };
 
-EL_FORCE_INLINE static void setupRayCast(const Ray& ray)
+Ray BSP::shrinkRay(const Ray& ray)
 {
 	Vector3 ndir = EPS_RAY_ENDS * normalize(ray.m_b - ray.m_a);
-	g_orig = ray.m_a + ndir;
-	g_dest = ray.m_b - ndir;
+	return Ray(ray.m_a + ndir, ray.m_b - ndir);
+}
+
+EL_FORCE_INLINE static void setupRayCast(const Ray& ray)
+{
+	Ray cast = BSP::shrinkRay(ray);
+	g_orig = cast.m_a;
+	g_dest = cast.m_b;
 	g_dir = g_dest - g_orig;
 
 	g_invdir.set(1.f/g_dir.x, 1.f/g_dir.y, 1.f/g_dir.z);
 	g_dirsgn[0] = *((unsigned int*)&g_invdir[0]) >> 31;
 	g_dirsgn[1] = *((unsigned int*)&g_invdir[1]) >> 31;
 	g_dirsgn[2] = *((unsigned int*)&g_invdir[2]) >> 31;
+	
+	int stackSize = g_recursionStackSize.load(std::memory_order_relaxed);
+	if( (int)g_recursionStack.size() <= stackSize ){ g_recursionStack.resize(stackSize+1); }
 }
 
 EL_FORCE_INLINE static float getSplitDistance(float splitPos, int axis)
@@ -595,33 +604,34 @@ EL_FORCE_INLINE static void getEnterExitDistances(const AABB& aabb, float& dEnte
 // Ray casts
 //------------------------------------------------------------------------
 
-EL_FORCE_INLINE static bool isectPolygonsAny(const Polygon** list, int numPolygons)
+EL_FORCE_INLINE static const Polygon* isectPolygonsAny(const Polygon** list, int numPolygons)
 {
     Ray ray(g_orig, g_dest);
     while( numPolygons-- )
     {
         const Polygon* poly = *list++;
-        if( ray.intersect(*poly) ){ return true; }
+        if( ray.intersect(*poly) ){ return poly; }
     }
     
-    return false;
+    return 0;
 }
 
 //------------------------------------------------------------------------
 
-EL_FORCE_INLINE static bool rayCastListAny(uintptr_t* listOrig, float dEnterOrig, float dExitOrig)
+EL_FORCE_INLINE static const Polygon* rayCastListAny(uintptr_t* listOrig, float dEnterOrig, float dExitOrig)
 {
     if( dEnterOrig < 0.f ){ dEnterOrig = 0.f; }
     if( dExitOrig  > 1.f ){ dExitOrig  = 1.f; }
     if( dEnterOrig > dExitOrig + EPS_DISTANCE ){ return 0; }
 
-	RecursionEntry* stack = g_recursionStack;
+	RecursionEntry* base = &g_recursionStack[0];
+	RecursionEntry* stack = base;
 	stack->ptr = listOrig;
 	stack->dEnter = dEnterOrig;
 	stack->dExit = dExitOrig;
 	stack++;
 
-	while( stack != g_recursionStack )
+	while( stack != base )
 	{
 		--stack;
 		uintptr_t* list = stack->ptr;
@@ -635,9 +645,10 @@ label_skipstack:
 		if( (pRight & 3) == 3 )
 		{
 			int numPolygons = pRight>>2;
-			if( isectPolygonsAny((const Polygon**)list, numPolygons) )
+			const Polygon* poly = isectPolygonsAny((const Polygon**)list, numPolygons);
+			if( poly )
             {
-				return true;
+				return poly;
             }
 			continue;
 		}
@@ -668,7 +679,7 @@ label_skipstack:
 		}
 	}
 
-	return false;
+	return 0;
 }
 
 bool BSP::rayCastAny(const Ray& ray) const
@@ -676,7 +687,17 @@ bool BSP::rayCastAny(const Ray& ray) const
     setupRayCast(ray);
     float dEnter, dExit;
     getEnterExitDistances(m_aabb, dEnter, dExit);
-    bool result = rayCastListAny(m_list, dEnter, dExit);
+    bool result = rayCastListAny(m_list, dEnter, dExit) != 0;
+    
+    return result;
+}
+
+const Polygon* BSP::rayCastOccluder(const Ray& ray) const
+{
+    setupRayCast(ray);
+    float dEnter, dExit;
+    getEnterExitDistances(m_aabb, dEnter, dExit);
+    const Polygon* result = rayCastListAny(m_list, dEnter, dExit);
     
     return result;
 }
@@ -717,13 +738,14 @@ EL_FORCE_INLINE static const Polygon* rayCastList(uintptr_t* listOrig, float dEn
     if( dExitOrig  > 1.f ){ dExitOrig  = 1.f; }
     if( dEnterOrig > dExitOrig+EPS_DISTANCE ){ return 0; }
     
-    RecursionEntry* stack = g_recursionStack;
+    RecursionEntry* base = &g_recursionStack[0];
+    RecursionEntry* stack = base;
     stack->ptr = listOrig;
     stack->dEnter = dEnterOrig;
     stack->dExit = dExitOrig;
     stack++;
     
-    while( stack != g_recursionStack )
+    while( stack != base )
     {
         --stack;
         uintptr_t* list = stack->ptr;
@@ -64,8 +64,14 @@ namespace EL
         void beamCast (const Beam& beam, std::vector<const Polygon*>& result) const;
         const Polygon* rayCast (const Ray& ray) const;
         bool rayCastAny (const Ray& ray) const;
+        // Any polygon blocking the ray, not necessarily the closest one
+        const Polygon* rayCastOccluder (const Ray& ray) const;
         static Vector3 getIntersectionPoint (void);
         
+        // The segment the ray casts test, its ends pulled in so that the
+        // polygons at the ends of the ray are not hit
+        static Ray shrinkRay (const Ray& ray);
+        
         class TempNode;
         
         
@@ -46,7 +46,17 @@
     #include <GL/gl.h>
 #endif
 
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
 #define printf // Comment to add debug logs
 
 using namespace EL;
@@ -64,22 +74,223 @@ static const float EPS_DEGENERATE_POLYGON_AREA = 1.0e-8;
 
 static const int DISTANCE_SKIP_BUCKET_SIZE = 16;
 
+// Margin added to the offsets of the packed fail planes against the rounding
+// of the distance computations, relative to the reach
+static const float FAIL_PLANE_MARGIN = 1.0e-5f;
+
+// Parallel updates are worth the threads from this many skip buckets on, and
+// split the buckets into about this many units of work per thread
+static const int PARALLEL_UPDATE_MIN_BUCKETS      = 256;
+static const int PARALLEL_UPDATE_UNITS_PER_THREAD = 8;
+
+// Number of skip spheres covered by a skip sphere of the next level
+static const int DISTANCE_SKIP_FANOUT = 16;
+
+// Similar paths are looked up in the cells overlapping an EPS_SIMILAR_PATHS
+// neighbourhood of their first reflection point
+static const float SIMILAR_PATHS_CELL_SIZE = 2.f*EPS_SIMILAR_PATHS;
+static const int PATH_HASH_MIN_SIZE = 1024;
+
+// FNV-1a constants for the path keys
+static const PathSolution::PathKey PATH_KEY_BASIS = 14695981039346656037ull;
+static const PathSolution::PathKey PATH_KEY_PRIME = 1099511628211ull;
+
 //------------------------------------------------------------------------
 
-struct PathSolution::SolutionNode
+// Parent node and convex element of the reflecting polygon, -1 on the root
+struct BeamTree::SolutionNode
 {
 public:
     int m_parent;
-    const Polygon* m_polygon;
+    int m_polygon;
+};
+
+struct PathSolution::PathHashEntry
+{
+public:
+    unsigned int m_stamp;
+    int m_path;
+};
+
+// Validation scratch and candidate paths of a thread of update()
+struct PathSolution::Worker
+{
+public:
+    PathSolution* m_solution;
+    int m_index;
+    
+    Vector3 m_source;
+    Vector3 m_target;
+    
+    std::vector<const Polygon*> m_polygonCache;
+    std::vector<Vector3> m_validateCache;
+    
+    std::vector<PathEntry> m_paths;
+    std::vector<Vector3> m_pathPoints;
+    std::vector<const Polygon*> m_pathPolygons;
+    
+    int m_numOccludedPaths;
+    int m_numOccluderCacheHits;
+    
+    void clear(void)
+    {
+        m_paths.clear();
+        m_pathPoints.clear();
+        m_pathPolygons.clear();
+    }
+};
+
+// Skip sphere whose subtree is validated by one worker
+struct PathSolution::UpdateUnit
+{
+public:
+    int m_sphere;
+    float m_radius;
+    int m_worker;
+    int m_firstPath;
+    int m_endPath;
+};
+
+// Beam of a solution node waiting to be expanded
+struct BeamTree::BeamNode
+{
+public:
+    int m_node;
+    int m_order;
+    Vector3 m_source;
+    Beam m_beam;
 };
 
+static double getTime(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec * 1.0e-6;
+}
+
+static EL_FORCE_INLINE float getSign(float x)
+{
+    return x < 0.f ? -1.f : 1.f;
+}
+
+static EL_FORCE_INLINE unsigned short quantizeUnit(float x)
+{
+    float t = .5f + .5f*x;
+    t = t < 0.f ? 0.f : (t > 1.f ? 1.f : t);
+    return (unsigned short)(t * 65535.f + .5f);
+}
+
+// Normal of an octahedral-encoded fail plane, on the octahedron so its
+// length is between 1/sqrt(3) and 1
+static EL_FORCE_INLINE Vector3 getFailNormal(unsigned short u, unsigned short v)
+{
+    Vector3 n(u * (2.f/65535.f) - 1.f, v * (2.f/65535.f) - 1.f, 0.f);
+    n.z = 1.f - fabsf(n.x) - fabsf(n.y);
+    if( n.z < 0.f )
+    {
+        float x = n.x;
+        n.x = (1.f - fabsf(n.y)) * getSign(x);
+        n.y = (1.f - fabsf(x)) * getSign(n.y);
+    }
+    return n;
+}
+
+// Morton code of a packed fail plane, the octahedral normal and the offset
+// quantized to 16 bits each and interleaved
+static unsigned long long getPlaneCode(unsigned short u, unsigned short v, float offset, float reach)
+{
+    unsigned int q[3] = { u, v, quantizeUnit(offset / reach) };
+    
+    unsigned long long code = 0;
+    for( int b=15; b >= 0; b-- )
+    {
+        for( int k=0; k < 3; k++ ){ code = (code << 1) | ((q[k] >> b) & 1u); }
+    }
+    return code;
+}
+
+static EL_FORCE_INLINE int getPathCell(float x)
+{
+    return (int)floorf(x * (1.f/SIMILAR_PATHS_CELL_SIZE));
+}
+
+static EL_FORCE_INLINE unsigned int hashPathCell(int x, int y, int z)
+{
+    return (unsigned int)x * 73856093u ^ (unsigned int)y * 19349663u ^ (unsigned int)z * 83492791u;
+}
+
+static EL_FORCE_INLINE PathSolution::PathKey hashPathKey(PathSolution::PathKey key, unsigned long value)
+{
+    return (key ^ value) * PATH_KEY_PRIME;
+}
+
+static PathSolution::PathKey hashPathKey(PathSolution::PathKey key, const std::string& name)
+{
+    for( int i=0; i < (int)name.size(); i++ ){ key = hashPathKey(key, (unsigned char)name[i]); }
+    return hashPathKey(key, 0ul);
+}
+
+static bool isSimilarPath(const PathSolution::Path& a, const PathSolution::Path& b)
+{
+    if( a.m_order != b.m_order ){ return false; }
+    
+    for( int j=1; j < a.numPoints()-1; j++ )
+    {
+        if( (a.m_points[j] - b.m_points[j]).lengthSqr() > EPS_SIMILAR_PATHS * EPS_SIMILAR_PATHS )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Lower bound for the length of the paths continuing a beam to the target:
+// the shortest way from the top of the beam through its window to the
+// target, which also bounds all the reflections beyond the window
+static float getBeamDistance(const Beam& beam, const Vector3& target)
+{
+    const Vector3& top = beam.getTop();
+    if( beam.numPleqs() == 0 ){ return (target - top).length(); }
+    
+    // A target on the same side of the window as the top is as far as its
+    // mirror image on the other side
+    Vector3 t = target;
+    if( dot(t, beam.getPleq(0)) < 0.f ){ t = mirror(t, beam.getPleq(0)); }
+    if( beam.contains(t) ){ return (t - top).length(); }
+    
+    // Otherwise the shortest way crosses an edge of the window: unfold the
+    // target around each edge line and clamp to the edge
+    const Polygon& poly = beam.getPolygon();
+    float best = 3.402823466e+38f;
+    Vector3 p1 = poly[poly.numPoints()-1];
+    for( int i=0; i < poly.numPoints(); i++ )
+    {
+        Vector3 p0 = p1;
+        p1 = poly[i];
+        Vector3 d = p1 - p0;
+        float len = d.length();
+        if( len <= 0.f ){ continue; }
+        d *= 1.f / len;
+        
+        float sa = dot(top - p0, d), sb = dot(t - p0, d);
+        float ra = (top - p0 - sa*d).length(), rb = (t - p0 - sb*d).length();
+        float s = ra + rb > 0.f ? sa + (sb - sa) * ra / (ra + rb) : sa;
+        s = s < 0.f ? 0.f : (s > len ? len : s);
+        
+        Vector3 p = p0 + s*d;
+        best = std::min(best, (p - top).length() + (t - p).length());
+    }
+    return best;
+}
+
 //------------------------------------------------------------------------
 void PathSolution::renderPath(const Path& path) const
 {
     glPushAttrib(GL_ALL_ATTRIB_BITS);
     
-    float width = 2.f*(m_maximumOrder-path.m_order+1.f);
-    float alpha = ((float)m_maximumOrder-path.m_order+4)/(m_maximumOrder+4);
+    int maximumOrder = m_tree->getOrder();
+    float width = 2.f*(maximumOrder-path.m_order+1.f);
+    float alpha = ((float)maximumOrder-path.m_order+4)/(maximumOrder+4);
     
     //	std::cerr << "Drawing path: width = " << width << ", alpha = " << alpha << std::endl;
     
@@ -89,7 +300,7 @@ void PathSolution::renderPath(const Path& path) const
     glColor4f(1.f, 1.f, 0.f, alpha);
     
     glBegin(GL_LINE_STRIP);
-    for( int i=0; i < (int)path.m_points.size(); i++ )
+    for( int i=0; i < path.numPoints(); i++ )
     {
         glVertex3fv(&path.m_points[i].x);
     }
@@ -100,7 +311,7 @@ void PathSolution::renderPath(const Path& path) const
     glEnable(GL_POINT_SMOOTH);
     glDepthMask(GL_FALSE);
     glBegin(GL_POINTS);
-    for( int i=0; i < (int)path.m_points.size(); i++ )
+    for( int i=0; i < path.numPoints(); i++ )
     {
         glVertex3fv(&path.m_points[i].x);
     }
@@ -110,155 +321,745 @@ void PathSolution::renderPath(const Path& path) const
 }
 //------------------------------------------------------------------------
 
-PathSolution::PathSolution(const Room& room, const Source& source, const Listener& listener, int maximumOrder, bool changed):
+BeamTree::BeamTree(const Room& room, const Vector3& source, const Vector3& target, int maximumOrder):
 m_room (room),
+m_snapshot (0),
 m_source (source),
-m_listener (listener),
+m_target (target),
+m_reach (0.f),
 m_maximumOrder (maximumOrder),
-m_changed (changed)
+m_cancelled (false),
+m_references (0),
+m_clusterNodes (true),
+m_nodeLimit (0),
+m_truncated (false),
+m_bestFirst (false),
+m_cache (0),
+m_frontierPos (0),
+m_parentBeam (new BeamNode()),
+m_completedOrder (-1),
+m_numPublishedNodes (0)
 {
-    m_polygonCache.resize(maximumOrder);
-    m_validateCache.resize(maximumOrder*2);
 }
 
-PathSolution::~PathSolution(void) {}
-
-//------------------------------------------------------------------------
+BeamTree::BeamTree(const RoomSnapshot& room, const Vector3& source, const Vector3& target, int maximumOrder):
+BeamTree(room.getRoom(), source, target, maximumOrder)
+{
+    // A shared room lives as long as the trees built on it
+    m_snapshot = &room;
+    m_snapshot->addReference();
+}
 
-void PathSolution::clearCache(void)
+BeamTree::~BeamTree(void)
 {
-    m_solutionNodes.clear();
-    m_failPlanes.clear();
+    delete m_parentBeam;
+    if( m_snapshot ){ m_snapshot->removeReference(); }
 }
 
 //------------------------------------------------------------------------
 
-void PathSolution::solve(void)
+void BeamTree::initialize(void)
 {
-    Vector3 source = m_source.getPosition();
-    Vector3 target = m_listener.getPosition();
+    m_solutionNodes.clear();
+    m_failPlanes.clear();
     
-    clearCache();
+    // The packed fail planes are exact enough for targets in and around
+    // the room
+    m_center = m_room.getCenter();
+    m_reach  = 2.f * m_room.getMaxLength();
     
-    // Create an empty root node
+    // Create an empty root node, the direct path is complete at once
     SolutionNode root;
-    root.m_polygon = 0;
+    root.m_polygon = -1;
     root.m_parent  = -1;
     m_solutionNodes.push_back(root);
+    m_failPlanes.push_back(packFailPlane(getFailPlane(Beam(), m_target)));
     
-    // Do the recursive solving from scratch
-    solveRecursive(source, target, Beam(), 0, 0);
+    m_frontier.clear();
+    m_nextFrontier.clear();
+    m_frontierPos = 0;
+    m_parentBeam->m_node = -2;
+    m_queuedBeams.clear();
+    m_freeSlots.clear();
+    m_queue.clear();
+    m_numQueued.assign(m_maximumOrder+1, 0);
     
-    if( stop_signal )
+    if( m_maximumOrder > 0 )
     {
-        printf ("Killed solution calculation\n");
-        return;
+        BeamNode node;
+        node.m_node   = 0;
+        node.m_order  = 0;
+        node.m_source = m_source;
+        if( m_bestFirst ){ queueBeam(node); }
+        else { m_frontier.push_back(0); }
     }
     
-    //printf ("Calculated full solution\n");
+    m_completedOrder = 0;
+    m_numPublishedNodes = 1;
+}
+
+bool BeamTree::solve(float timeBudget, int nodeBudget)
+{
+    if( m_completedOrder < 0 )
+    {
+        initialize();
+        if( m_cache && m_cache->load(*this) ){ return true; }
+    }
+    if( m_bestFirst ){ return solveBestFirst(timeBudget, nodeBudget); }
+    
+    double startTime = getTime();
+    int numExpanded = 0;
+    
+    while( !isComplete() )
+    {
+        // Forced stop, keep the orders completed so far
+        if( isCancelled() )
+        {
+            printf ("Killed solution calculation\n");
+            return false;
+        }
+        
+        // Out of nodes: publish what there is of the current order and stop
+        if( m_nodeLimit > 0 && (int)m_solutionNodes.size() >= m_nodeLimit )
+        {
+            if( (int)m_solutionNodes.size() > m_numPublishedNodes )
+            {
+                if( m_clusterNodes ){ clusterNodes(m_numPublishedNodes); }
+                m_completedOrder++;
+                m_numPublishedNodes = m_solutionNodes.size();
+            }
+            m_truncated = true;
+            printf ("Node limit reached, beam tree truncated at order %d with %d nodes\n", m_completedOrder, getNumNodes());
+            break;
+        }
+        
+        // All the beams of the current order expanded: publish the next order
+        if( m_frontierPos == (int)m_frontier.size() )
+        {
+            if( m_clusterNodes ){ clusterNodes(m_numPublishedNodes); }
+            m_completedOrder++;
+            m_numPublishedNodes = m_solutionNodes.size();
+            m_frontier.swap(m_nextFrontier);
+            m_nextFrontier.clear();
+            m_frontierPos = 0;
+            if( m_nodeLimit > 0 ){ prioritizeFrontier(); }
+            continue;
+        }
+        
+        // Out of budget? Always expand at least one beam per call
+        if( numExpanded > 0 )
+        {
+            if( nodeBudget > 0 && numExpanded >= nodeBudget ){ return false; }
+            if( timeBudget > 0.f && getTime() - startTime >= timeBudget ){ return false; }
+        }
+        
+        BeamNode node;
+        buildBeam(m_frontier[m_frontierPos++], node);
+        expandBeam(node, m_completedOrder);
+        numExpanded++;
+    }
     
-    // Record the current source
-    m_cachedSource = source;
+    //printf ("Calculated full solution\n");
     EL_ASSERT(m_solutionNodes.size() == m_failPlanes.size());
     
-    // Initialize the buckets
-    int numBuckets = (m_solutionNodes.size() + DISTANCE_SKIP_BUCKET_SIZE - 1) / DISTANCE_SKIP_BUCKET_SIZE;
-    m_distanceSkipCache.resize(numBuckets);
-    for( int i=0; i < numBuckets; i++ )
+    // Release the frontiers
+    std::vector<int>().swap(m_frontier);
+    std::vector<int>().swap(m_nextFrontier);
+    
+    if( m_cache && !m_truncated ){ m_cache->copy(*this, m_cacheData); }
+    return true;
+}
+
+bool BeamTree::saveToCache(void)
+{
+    if( m_cacheData.empty() ){ return false; }
+    bool ok = m_cache->save(m_cacheData);
+    std::vector<char>().swap(m_cacheData);
+    return ok;
+}
+
+//------------------------------------------------------------------------
+
+// Header of a cached tree file, followed by the nodes and then the fail
+// planes. All of it is 8-byte aligned, the arrays are read off a mapping.
+// The source is kept bit for bit, the grid only names the file
+struct BeamTreeCache::Header
+{
+public:
+    char m_magic[8];
+    unsigned long long m_roomHash;
+    float m_source[3];
+    int m_order;
+    int m_completedOrder;
+    int m_numNodes;
+};
+
+static const char BEAM_TREE_CACHE_MAGIC[8] = { 'E', 'L', 'B', 'E', 'A', 'M', 'S', '2' };
+
+BeamTreeCache::BeamTreeCache(const char* directory, float gridSize):
+m_directory (directory),
+m_gridSize (gridSize > 0.f ? gridSize : 0.001f)
+{
+}
+
+BeamTreeCache::~BeamTreeCache(void) {}
+
+void BeamTreeCache::getKey(const BeamTree& tree, Header& header) const
+{
+    memset(&header, 0, sizeof(header));
+    memcpy(header.m_magic, BEAM_TREE_CACHE_MAGIC, sizeof(header.m_magic));
+    header.m_roomHash = tree.m_room.getHash();
+    for( int i=0; i < 3; i++ ){ header.m_source[i] = tree.m_source[i]; }
+    header.m_order = tree.m_maximumOrder;
+}
+
+std::string BeamTreeCache::getFileName(const Header& key) const
+{
+    int position[3];
+    for( int i=0; i < 3; i++ ){ position[i] = (int)floorf(key.m_source[i] / m_gridSize + .5f); }
+    
+    char name[128];
+    snprintf(name, sizeof(name), "/%016llx_%d_%d_%d_%d.beams", key.m_roomHash,
+             position[0], position[1], position[2], key.m_order);
+    return m_directory + name;
+}
+
+bool BeamTreeCache::load(BeamTree& tree) const
+{
+    if( tree.m_room.numConvexElements() == 0 ){ return false; }
+    
+    Header key;
+    getKey(tree, key);
+    int fd = open(getFileName(key).c_str(), O_RDONLY);
+    if( fd < 0 ){ return false; }
+    
+    struct stat info;
+    void* data = MAP_FAILED;
+    if( fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(Header) )
     {
-        m_distanceSkipCache[i].set(0,0,0,0);
+        data = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
     }
+    close(fd);
+    if( data == MAP_FAILED ){ return false; }
+    
+    // The name matches any source of the grid cell, and another room or
+    // grid size on a hash collision. Check the key and the contents
+    const Header* header = (const Header*)data;
+    int n = header->m_numNodes;
+    const BeamTree::SolutionNode* nodes = (const BeamTree::SolutionNode*)(header+1);
+    const BeamTree::FailPlane* planes = (const BeamTree::FailPlane*)(nodes+n);
+    
+    bool valid = !memcmp(header->m_magic, key.m_magic, sizeof(key.m_magic)) &&
+                 header->m_roomHash == key.m_roomHash &&
+                 !memcmp(header->m_source, key.m_source, sizeof(key.m_source)) &&
+                 header->m_order == key.m_order &&
+                 header->m_completedOrder == key.m_order &&
+                 n > 0 && (tree.m_nodeLimit <= 0 || n <= tree.m_nodeLimit) &&
+                 (size_t)info.st_size == sizeof(Header) + n*(sizeof(BeamTree::SolutionNode)+sizeof(BeamTree::FailPlane));
+    
+    // The parents are stored before their children, no walk up loops
+    for( int i=1; valid && i < n; i++ )
+    {
+        valid = nodes[i].m_parent >= 0 && nodes[i].m_parent < i &&
+                nodes[i].m_polygon >= 0 && nodes[i].m_polygon < tree.m_room.numConvexElements();
+    }
+    
+    if( valid )
+    {
+        tree.m_solutionNodes.assign(nodes, nodes+n);
+        tree.m_failPlanes.assign(planes, planes+n);
+        tree.m_completedOrder = header->m_completedOrder;
+        tree.m_numPublishedNodes = n;
+        
+        // Release the beams of the initialized tree
+        std::vector<int>().swap(tree.m_frontier);
+        std::vector<BeamTree::BeamNode>().swap(tree.m_queuedBeams);
+        std::vector<int>().swap(tree.m_freeSlots);
+        std::vector< std::pair<float, int> >().swap(tree.m_queue);
+    }
+    
+    munmap(data, info.st_size);
+    return valid;
+}
+
+void BeamTreeCache::copy(const BeamTree& tree, std::vector<char>& data) const
+{
+    Header header;
+    getKey(tree, header);
+    header.m_completedOrder = tree.m_completedOrder;
+    header.m_numNodes = tree.m_numPublishedNodes;
+    size_t n = header.m_numNodes;
+    
+    size_t nodesSize = n*sizeof(BeamTree::SolutionNode);
+    data.resize(sizeof(Header) + nodesSize + n*sizeof(BeamTree::FailPlane));
+    memcpy(&data[0], &header, sizeof(Header));
+    memcpy(&data[sizeof(Header)], &tree.m_solutionNodes[0], nodesSize);
+    memcpy(&data[sizeof(Header) + nodesSize], &tree.m_failPlanes[0], n*sizeof(BeamTree::FailPlane));
+}
+
+bool BeamTreeCache::save(const std::vector<char>& data) const
+{
+    if( data.size() < sizeof(Header) ){ return false; }
+    
+    // Write a temporary file and rename it over the old one, so that
+    // readers never map a partial file
+    std::string fileName = getFileName(*(const Header*)&data[0]);
+    std::string tempName = fileName + ".XXXXXX";
+    int fd = mkstemp(&tempName[0]);
+    if( fd < 0 ){ return false; }
+    
+    FILE* f = fdopen(fd, "wb");
+    if( !f )
+    {
+        close(fd);
+        unlink(tempName.c_str());
+        return false;
+    }
+    
+    bool ok = fwrite(&data[0], 1, data.size(), f) == data.size();
+    ok = fclose(f) == 0 && ok;
+    chmod(tempName.c_str(), 0644);
+    ok = ok && rename(tempName.c_str(), fileName.c_str()) == 0;
+    if( !ok ){ unlink(tempName.c_str()); }
+    return ok;
+}
+
+//------------------------------------------------------------------------
+
+struct UpdatePool::State
+{
+public:
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_startCond;
+    pthread_cond_t m_doneCond;
+    std::vector<pthread_t> m_threads;
+    
+    // The call of the current run, counted up by each run
+    void (*m_function)(void*, int);
+    void* m_data;
+    unsigned int m_generation;
+    int m_numRunning;
+    int m_numStarted;
+    bool m_stopping;
+};
+
+UpdatePool::UpdatePool(int numThreads):
+m_numThreads (numThreads > 1 ? numThreads : 1),
+m_state (new State())
+{
+    pthread_mutex_init(&m_state->m_mutex, 0);
+    pthread_cond_init(&m_state->m_startCond, 0);
+    pthread_cond_init(&m_state->m_doneCond, 0);
+    m_state->m_function   = 0;
+    m_state->m_data       = 0;
+    m_state->m_generation = 0;
+    m_state->m_numRunning = 0;
+    m_state->m_numStarted = 0;
+    m_state->m_stopping   = false;
+    
+    // A thread that fails to start leaves its share to the others
+    for( int i=1; i < m_numThreads; i++ )
+    {
+        pthread_t thread;
+        if( pthread_create(&thread, 0, runThread, this) == 0 ){ m_state->m_threads.push_back(thread); }
+    }
+}
+
+UpdatePool::~UpdatePool(void)
+{
+    pthread_mutex_lock(&m_state->m_mutex);
+    m_state->m_stopping = true;
+    pthread_cond_broadcast(&m_state->m_startCond);
+    pthread_mutex_unlock(&m_state->m_mutex);
+    
+    for( int i=0; i < (int)m_state->m_threads.size(); i++ ){ pthread_join(m_state->m_threads[i], 0); }
+    
+    pthread_cond_destroy(&m_state->m_doneCond);
+    pthread_cond_destroy(&m_state->m_startCond);
+    pthread_mutex_destroy(&m_state->m_mutex);
+    delete m_state;
+}
+
+void UpdatePool::run(void (*function)(void*, int), void* data)
+{
+    State& state = *m_state;
+    
+    pthread_mutex_lock(&state.m_mutex);
+    state.m_function   = function;
+    state.m_data       = data;
+    state.m_numRunning = state.m_threads.size();
+    state.m_generation++;
+    pthread_cond_broadcast(&state.m_startCond);
+    pthread_mutex_unlock(&state.m_mutex);
+    
+    function(data, 0);
+    
+    pthread_mutex_lock(&state.m_mutex);
+    while( state.m_numRunning > 0 ){ pthread_cond_wait(&state.m_doneCond, &state.m_mutex); }
+    pthread_mutex_unlock(&state.m_mutex);
+}
+
+void* UpdatePool::runThread(void* data)
+{
+    State& state = *((UpdatePool*)data)->m_state;
+    
+    // Runs started before the thread are still ahead of generation zero
+    pthread_mutex_lock(&state.m_mutex);
+    int index = ++state.m_numStarted;
+    unsigned int generation = 0;
+    while( 1 )
+    {
+        while( state.m_generation == generation && !state.m_stopping ){ pthread_cond_wait(&state.m_startCond, &state.m_mutex); }
+        if( state.m_stopping ){ break; }
+        generation = state.m_generation;
+        
+        pthread_mutex_unlock(&state.m_mutex);
+        state.m_function(state.m_data, index);
+        pthread_mutex_lock(&state.m_mutex);
+        
+        if( --state.m_numRunning == 0 ){ pthread_cond_signal(&state.m_doneCond); }
+    }
+    pthread_mutex_unlock(&state.m_mutex);
+    return 0;
+}
+
+//------------------------------------------------------------------------
+
+PathSolution::PathSolution(const Room& room, const Source& source, const Listener& listener, int maximumOrder, bool changed):
+m_tree (new BeamTree(room, source.getPosition(), listener.getPosition(), maximumOrder)),
+m_source (source),
+m_listener (listener),
+m_changed (changed),
+m_reciprocal (false),
+m_numThreads (1),
+m_pool (0),
+m_ownPool (false),
+m_unitLevel (0),
+m_unitCursor (0),
+m_pathHashStamp (1),
+m_numSkipCacheNodes (0),
+m_numOccludedPaths (0),
+m_numOccluderCacheHits (0)
+{
+    m_tree->addReference();
+    initialize();
+}
+
+PathSolution::PathSolution(BeamTree* tree, const Source& source, const Listener& listener, bool changed, bool reciprocal):
+m_tree (tree),
+m_source (source),
+m_listener (listener),
+m_changed (changed),
+m_reciprocal (reciprocal),
+m_numThreads (1),
+m_pool (0),
+m_ownPool (false),
+m_unitLevel (0),
+m_unitCursor (0),
+m_pathHashStamp (1),
+m_numSkipCacheNodes (0),
+m_numOccludedPaths (0),
+m_numOccluderCacheHits (0)
+{
+    m_tree->addReference();
+    initialize();
+}
+
+PathSolution::~PathSolution(void)
+{
+    for( int i=0; i < (int)m_workers.size(); i++ ){ delete m_workers[i]; }
+    if( m_ownPool ){ delete m_pool; }
+    m_tree->removeReference();
+}
+
+void PathSolution::initialize(void)
+{
+    setNumThreads(1);
+    
+    // Paths of different source-listener pairs never share a key
+    m_pathKeySeed = hashPathKey(hashPathKey(PATH_KEY_BASIS, m_source.getName()), m_listener.getName());
+}
+
+void PathSolution::setNumThreads(int numThreads)
+{
+    numThreads = numThreads > 1 ? numThreads : 1;
+    if( m_pool && m_pool->getNumThreads() == numThreads ){ return; }
+    
+    setUpdatePool(numThreads > 1 ? new UpdatePool(numThreads) : 0);
+    m_ownPool = m_pool != 0;
+}
+
+void PathSolution::setUpdatePool(UpdatePool* pool)
+{
+    if( m_ownPool ){ delete m_pool; }
+    m_pool = pool;
+    m_ownPool = false;
+    m_numThreads = pool ? pool->getNumThreads() : 1;
+    
+    int maximumOrder = m_tree->getOrder();
+    while( (int)m_workers.size() < m_numThreads )
+    {
+        Worker* worker = new Worker();
+        worker->m_solution = this;
+        worker->m_index    = m_workers.size();
+        worker->m_polygonCache.resize(maximumOrder);
+        worker->m_validateCache.resize(maximumOrder*2);
+        worker->m_numOccludedPaths     = 0;
+        worker->m_numOccluderCacheHits = 0;
+        m_workers.push_back(worker);
+    }
+}
+
+bool PathSolution::solve(float timeBudget, int nodeBudget)
+{
+    bool done = m_tree->solve(timeBudget, nodeBudget);
+    if( done ){ m_tree->saveToCache(); }
+    return done;
 }
 
 void PathSolution::update(void)
 {
     //printf ("Solution Update\n");
     
-    int numProc   = 0;
-    int numTested = 0;
-    
+    // The image-source method is reciprocal: a tree rooted at the listener
+    // is validated towards the source
     Vector3 source = m_source.getPosition();
     Vector3 target = m_listener.getPosition();
+    if( m_reciprocal ){ swap(source, target); }
     
-    // Clear all paths
+    // Clear all paths keeping the buffers allocated
     m_paths.clear();
+    m_pathPoints.clear();
+    m_pathPolygons.clear();
+    if( ++m_pathHashStamp == 0 )
+    {
+        // Stamp wrapped around, really clear the table
+        for( int i=0; i < (int)m_pathHash.size(); i++ ){ m_pathHash[i].m_stamp = 0; }
+        m_pathHashStamp = 1;
+    }
     
     // If we do not have any previous solution or the source has moved
-    if( !m_solutionNodes.size() || m_cachedSource != source )
+    if( !m_tree->m_numPublishedNodes || m_tree->getSource() != source )
     {
-        if( m_cachedSource != source )
+        if( m_tree->getSource() != source )
         {
             printf ("Source changed! You should solve() instead of update()\n");
         }
-        if( ! m_solutionNodes.size () )
+        if( ! m_tree->m_numPublishedNodes )
         {
             printf ("No solution! You should solve() instead of update()\n");
         }
         return;
     }
     
-    // Number of solution nodes
-    int n = m_solutionNodes.size();
+    // Number of solution nodes in the completed orders
+    int n = m_tree->m_numPublishedNodes;
     
-    // Number of buckets
-    int nb = (m_solutionNodes.size() + DISTANCE_SKIP_BUCKET_SIZE - 1) / DISTANCE_SKIP_BUCKET_SIZE;
+    // New orders were published since the last update: the fail planes of
+    // the new nodes start from the ones of the tree, and on each level the
+    // last skip sphere may cover new nodes so it is no longer valid
+    if( m_numSkipCacheNodes != n )
+    {
+        for( int i=m_failPlanes.size(); i < n; i++ ){ m_failPlanes.push_back(m_tree->m_failPlanes[i]); }
+        m_occluders.resize(n, 0);
+        
+        int size = (n + DISTANCE_SKIP_BUCKET_SIZE - 1) / DISTANCE_SKIP_BUCKET_SIZE;
+        for( int level=0; ; level++ )
+        {
+            if( level == (int)m_distanceSkipCache.size() ){ m_distanceSkipCache.push_back(std::vector<Vector4>()); }
+            
+            std::vector<Vector4>& spheres = m_distanceSkipCache[level];
+            if( !spheres.empty() ){ spheres.back().set(0,0,0,0); }
+            spheres.resize(size, Vector4(0,0,0,0));
+            
+            if( size == 1 ){ break; }
+            size = (size + DISTANCE_SKIP_FANOUT - 1) / DISTANCE_SKIP_FANOUT;
+        }
+        m_numSkipCacheNodes = n;
+    }
     
-    // Take the first bucket skip sphere
-    const Vector4* skipSphere = &m_distanceSkipCache[0];
+    // Descend from the single sphere of the top level, on the calling thread
+    // unless the tree has enough buckets to share among the workers
+    if( m_numThreads > 1 && (int)m_distanceSkipCache[0].size() >= PARALLEL_UPDATE_MIN_BUCKETS )
+    {
+        updateParallel(source, target);
+    }
+    else
+    {
+        Worker& worker = *m_workers[0];
+        worker.clear();
+        updateSkipSphere(m_distanceSkipCache.size()-1, 0, source, target, worker);
+        mergePaths(worker, 0, worker.m_paths.size());
+    }
     
-    // Do for each bucket
-    for( int b=0; b < nb; b++ )
+    for( int i=0; i < (int)m_workers.size(); i++ )
     {
-        // Test if the listener is inside the skip sphere
-        // skip the rest of the tests if it is
-        const Vector4& fc = *skipSphere++;
-        Vector3 r = target - Vector3(fc.x, fc.y, fc.z);
-        if( r.lengthSqr() < fc.w ){ continue; }
-        
-        // Initialize the skip sphere radius to zero
-        float maxdot = 0.f;
-        numProc++;
+        m_numOccludedPaths     += m_workers[i]->m_numOccludedPaths;
+        m_numOccluderCacheHits += m_workers[i]->m_numOccluderCacheHits;
+        m_workers[i]->m_numOccludedPaths     = 0;
+        m_workers[i]->m_numOccluderCacheHits = 0;
+    }
+}
+
+void PathSolution::updateParallel(const Vector3& source, const Vector3& target)
+{
+    // Split at the highest level with enough spheres to balance the load,
+    // the spheres on that level not skipped from above are the units of work
+    int top = m_distanceSkipCache.size()-1;
+    m_unitLevel = top;
+    while( m_unitLevel > 0 && (int)m_distanceSkipCache[m_unitLevel].size() < PARALLEL_UPDATE_UNITS_PER_THREAD*m_numThreads )
+    {
+        m_unitLevel--;
+    }
+    m_units.clear();
+    combineSkipSpheres(top, 0, target, true);
+    
+    // The workers take the units one at a time on the threads of the pool,
+    // the calling thread is the first worker
+    m_nextUnit.store(0);
+    for( int i=0; i < m_numThreads; i++ )
+    {
+        m_workers[i]->clear();
+        m_workers[i]->m_source = source;
+        m_workers[i]->m_target = target;
+    }
+    m_pool->run(runWorker, this);
+    
+    // Merge in the order of the units, so that the same paths survive the
+    // removal of similar paths as in a serial update
+    for( int i=0; i < (int)m_units.size(); i++ )
+    {
+        const UpdateUnit& unit = m_units[i];
+        mergePaths(*m_workers[unit.m_worker], unit.m_firstPath, unit.m_endPath);
+    }
+    
+    // Update the skip spheres above the units
+    m_unitCursor = 0;
+    combineSkipSpheres(top, 0, target, false);
+}
+
+void PathSolution::runWorker(void* data, int index)
+{
+    PathSolution* solution = (PathSolution*)data;
+    Worker* worker = solution->m_workers[index];
+    
+    int numUnits = solution->m_units.size();
+    for( int i = solution->m_nextUnit++; i < numUnits; i = solution->m_nextUnit++ )
+    {
+        UpdateUnit& unit = solution->m_units[i];
+        unit.m_worker    = worker->m_index;
+        unit.m_firstPath = worker->m_paths.size();
+        unit.m_radius    = solution->updateSkipSphere(solution->m_unitLevel, unit.m_sphere, worker->m_source, worker->m_target, *worker);
+        unit.m_endPath   = worker->m_paths.size();
+    }
+}
+
+float PathSolution::combineSkipSpheres(int level, int index, const Vector3& target, bool collect)
+{
+    // The workers test the skip spheres of the units themselves, their radii
+    // are known once the workers are done
+    if( level == m_unitLevel )
+    {
+        if( !collect ){ return m_units[m_unitCursor++].m_radius; }
         
+        UpdateUnit unit;
+        unit.m_sphere = index;
+        m_units.push_back(unit);
+        return 0.f;
+    }
+    
+    Vector4& sphere = m_distanceSkipCache[level][index];
+    float distSqr = (target - Vector3(sphere.x, sphere.y, sphere.z)).lengthSqr();
+    if( distSqr < sphere.w*sphere.w ){ return sphere.w - sqrtf(distSqr); }
+    
+    const std::vector<Vector4>& below = m_distanceSkipCache[level-1];
+    int imn = index * DISTANCE_SKIP_FANOUT;
+    int imx = imn + DISTANCE_SKIP_FANOUT;
+    if( imx > (int)below.size() ){ imx = below.size(); }
+    
+    float radius = 0.f;
+    for( int i=imn; i < imx; i++ )
+    {
+        float r = combineSkipSpheres(level-1, i, target, collect);
+        if( i == imn || r < radius ){ radius = r; }
+    }
+    
+    if( !collect && radius > 0.f ){ sphere.set(target.x, target.y, target.z, radius); }
+    return radius;
+}
+
+float PathSolution::updateSkipSphere(int level, int index, const Vector3& source, const Vector3& target, Worker& worker)
+{
+    // Test if the listener is inside the skip sphere
+    // skip the rest of the tests if it is
+    Vector4& sphere = m_distanceSkipCache[level][index];
+    float distSqr = (target - Vector3(sphere.x, sphere.y, sphere.z)).lengthSqr();
+    if( distSqr < sphere.w*sphere.w ){ return sphere.w - sqrtf(distSqr); }
+    
+    float radius;
+    if( level == 0 )
+    {
         // Go through the nodes in the bucket
-        int imn = b * DISTANCE_SKIP_BUCKET_SIZE;
+        int n   = m_tree->m_numPublishedNodes;
+        int imn = index * DISTANCE_SKIP_BUCKET_SIZE;
         int imx = imn + DISTANCE_SKIP_BUCKET_SIZE;
         if( imx > n ){ imx = n; }
+        
+        Vector3 relTarget = target - m_tree->m_center;
+        
+        bool valid = false;
+        float maxdot = 0.f;
         for( int i=imn; i < imx; i++ )
         {
-            // Calculate the distance from the listener to the fail plane
-            float d = dot(target, m_failPlanes[i]);
+            // Calculate the scaled distance from the listener to the fail plane
+            const BeamTree::FailPlane& plane = m_failPlanes[i];
+            Vector3 normal = getFailNormal(plane.m_u, plane.m_v);
+            float d = dot(relTarget, normal) + plane.m_offset;
             
             // If the distance is positive or zero, the path is inside the
             // beam and must be validated for occlusion
             if( d >= 0.f )
             {
-                validatePath(source, target, i, m_failPlanes[i]);
-                numTested++;
+                validatePath(source, target, i, m_failPlanes[i], worker);
+                valid = true;
             }
             
-            // Record the maximum distance
-            if( i == imn || d > maxdot ){ maxdot = d; }
+            // Record the maximum distance as long as the bucket may be
+            // skipped, only then it needs to be unscaled
+            else if( !valid )
+            {
+                d /= normal.length();
+                if( i == imn || d > maxdot ){ maxdot = d; }
+            }
         }
         
         // If all paths were on the wrong side of the fail planes, the skip sphere
         // can be set to be the distance to the nearest fail plane
         // Note: max (-x) = - min (x)
-        if( maxdot < 0.f )
+        radius = valid ? 0.f : -maxdot;
+    }
+    else
+    {
+        // The listener may move as far as the closest boundary of the
+        // spheres below before any of their nodes can become valid
+        const std::vector<Vector4>& below = m_distanceSkipCache[level-1];
+        int imn = index * DISTANCE_SKIP_FANOUT;
+        int imx = imn + DISTANCE_SKIP_FANOUT;
+        if( imx > (int)below.size() ){ imx = below.size(); }
+        
+        radius = 0.f;
+        for( int i=imn; i < imx; i++ )
         {
-            m_distanceSkipCache[b].set(target.x, target.y, target.z, maxdot*maxdot);
+            float r = updateSkipSphere(level-1, i, source, target, worker);
+            if( i == imn || r < radius ){ radius = r; }
         }
     }
     
-    m_pathFirstSet.clear();
-    
-    /*
-     printf("paths: %d (proc %d = %.2f %%, tested %d, valid %d)\n",
-     m_solutionNodes.size(), numProc * DISTANCE_SKIP_BUCKET_SIZE,
-     (float)numProc/nb*100.f, numTested, m_paths.size());
-     */
+    if( radius > 0.f ){ sphere.set(target.x, target.y, target.z, radius); }
+    return radius;
 }
 
-Vector4 PathSolution::getFailPlane(const Beam& beam, const Vector3& target)
+Vector4 BeamTree::getFailPlane(const Beam& beam, const Vector3& target)
 {
     // Go through all the planes defining the beam
     // Find the plane whose distance to the listaner is smallest
@@ -278,24 +1079,73 @@ Vector4 PathSolution::getFailPlane(const Beam& beam, const Vector3& target)
     return failPlane;
 }
 
+size_t BeamTree::getMemorySize(void) const
+{
+    return m_solutionNodes.capacity()*sizeof(SolutionNode) + m_failPlanes.capacity()*sizeof(FailPlane);
+}
+
+const Polygon* BeamTree::getPolygon(int nodeIndex) const
+{
+    return &m_room.getConvexElement(m_solutionNodes[nodeIndex].m_polygon).m_polygon;
+}
+
+BeamTree::FailPlane BeamTree::packFailPlane(const Vector4& plane) const
+{
+    // Normalize, a plane without a normal fails nowhere or everywhere
+    Vector3 n(plane.x, plane.y, plane.z);
+    float len = n.length();
+    float w = plane.w;
+    if( len > 0.f ){ n *= 1.f/len; w /= len; }
+    
+    // Project the normal on the octahedron and fold the lower half over
+    float l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+    Vector3 o = l1 > 0.f ? n * (1.f/l1) : Vector3(0.f, 0.f, 1.f);
+    if( o.z < 0.f )
+    {
+        float x = o.x;
+        o.x = (1.f - fabsf(o.y)) * getSign(x);
+        o.y = (1.f - fabsf(x)) * getSign(o.y);
+    }
+    
+    FailPlane packed;
+    packed.m_u = quantizeUnit(o.x);
+    packed.m_v = quantizeUnit(o.y);
+    
+    // Push the plane out by the largest change of the distance the rounded
+    // normal causes within the reach, plus the rounding of the distance
+    // computation, so that a target is never moved to the failing side.
+    // The offset is scaled like the decoded normal, which is not unit
+    Vector3 m = getFailNormal(packed.m_u, packed.m_v);
+    float scale = m.length();
+    Vector3 error = m * (1.f/scale) - n;
+    packed.m_offset = (dot(m_center, n) + w + error.length() * m_reach + FAIL_PLANE_MARGIN * (1.f + m_reach)) * scale;
+    
+    return packed;
+}
+
 void PathSolution::validatePath(const Vector3& source,
                                 const Vector3& target,
                                 int nodeIndex,
-                                Vector4& failPlane)
+                                BeamTree::FailPlane& failPlane,
+                                Worker& worker)
 {
+    std::vector<const Polygon*>& polygonCache = worker.m_polygonCache;
+    std::vector<Vector3>& validateCache = worker.m_validateCache;
+    
     // Collect polygons in the path from this node to the root
     int order = 0;
+    const Polygon*& occluder = m_occluders[nodeIndex];
     while( nodeIndex )
     {
-        m_polygonCache[order++] = m_solutionNodes[nodeIndex].m_polygon;
-        nodeIndex = m_solutionNodes[nodeIndex].m_parent;
+        polygonCache[order++] = m_tree->getPolygon(nodeIndex);
+        nodeIndex = m_tree->m_solutionNodes[nodeIndex].m_parent;
     }
     
     // Reconstruct image source for this level
     Vector3 imgSource = source;
     for( int i=order-1; i >= 0; i-- )
     {
-        imgSource = mirror(imgSource, m_polygonCache[i]->getPleq());
+        imgSource = mirror(imgSource, polygonCache[i]->getPleq());
     }
     
     // Test for polygon miss and failed reflection
@@ -311,7 +1161,7 @@ void PathSolution::validatePath(const Vector3& source,
     
     for( int i=0; i < order; i++ )
     {
-        const Polygon* poly = m_polygonCache[i];
+        const Polygon* poly = polygonCache[i];
         const Vector4& pleq = poly->getPleq();
         Ray ray(s, t);
         
@@ -343,8 +1193,8 @@ void PathSolution::validatePath(const Vector3& source,
         t = isect;
         
         // Record intersection points and images sources
-        m_validateCache[i*2] = isect;
-        m_validateCache[i*2+1] = s;
+        validateCache[i*2] = isect;
+        validateCache[i*2+1] = s;
     }
     
     // Path missed a polygon?
@@ -379,7 +1229,7 @@ void PathSolution::validatePath(const Vector3& source,
         // Mirror the fail plane according to the remaining polygons in the path
         for( int i=missOrder-1; i >= 0; i-- )
         {
-            missPlane = mirror(missPlane, m_polygonCache[i]->getPleq());
+            missPlane = mirror(missPlane, polygonCache[i]->getPleq());
         }
         
         // Because of numerical inaccuracies, we may end up on wrong side
@@ -390,7 +1240,7 @@ void PathSolution::validatePath(const Vector3& source,
             imgSource = source;
             for( int i=order-1; i >= 0; i-- )
             {
-                Polygon poly = *m_polygonCache[i];
+                Polygon poly = *polygonCache[i];
                 poly.clip(beam);
                 
                 imgSource = mirror(imgSource, poly.getPleq());
@@ -398,96 +1248,171 @@ void PathSolution::validatePath(const Vector3& source,
             }
             
             // Update the fail plane
-            missPlane = getFailPlane(beam, target);
+            missPlane = BeamTree::getFailPlane(beam, target);
         }
         
         // Done, normalize to be sure
-        failPlane = normalize(missPlane);
+        failPlane = m_tree->packFailPlane(normalize(missPlane));
         return;
     }
     
-    // Test for occlusion
+    // Test for occlusion, first against the polygon that blocked the path
+    // of this node the last time as it most likely still does. The segment
+    // is the one the ray cast tests, so a hit here is one it would find
+    if( occluder )
+    {
+        t = target;
+        for( int i=0; i <= order; i++ )
+        {
+            Vector3 isect = i < order ? validateCache[i*2] : source;
+            if( BSP::shrinkRay(Ray(isect, t)).intersect(*occluder) )
+            {
+                worker.m_numOccludedPaths++;
+                worker.m_numOccluderCacheHits++;
+                return;
+            }
+            t = isect;
+        }
+    }
+    
     // Go through the path segments with a fast ray tracer
     t = target;
-    for( int i=0; i < order; i++ )
+    for( int i=0; i <= order; i++ )
     {
-        Vector3 isect = m_validateCache[i*2];
-        if( m_room.getBSP().rayCastAny(Ray(isect, t)) ){ return; }
+        Vector3 isect = i < order ? validateCache[i*2] : source;
+        const Polygon* poly = m_tree->m_room.getBSP().rayCastOccluder(Ray(isect, t));
+        if( poly )
+        {
+            occluder = poly;
+            worker.m_numOccludedPaths++;
+            return;
+        }
         t = isect;
     }
-    if( m_room.getBSP().rayCastAny(Ray(source, t)) ){ return; }
+    occluder = 0;
+    
+    // Validated, append to the candidate paths of the worker, similar paths
+    // are removed when merging them
+    PathEntry entry;
+    entry.m_order        = order;
+    entry.m_firstPoint   = worker.m_pathPoints.size();
+    entry.m_firstPolygon = worker.m_pathPolygons.size();
+    
+    worker.m_pathPoints.resize(entry.m_firstPoint + order+2);
+    worker.m_pathPolygons.resize(entry.m_firstPolygon + order);
     
-    // Validated, add to results
-    Path path;
-    path.m_order = order;
-    path.m_points.resize(order+2);
-    path.m_polygons.resize(order);
+    Vector3* points = &worker.m_pathPoints[entry.m_firstPoint];
+    const Polygon** polygons = order ? &worker.m_pathPolygons[entry.m_firstPolygon] : 0;
     
     t = target;
     for( int i=0; i < order; i++ )
     {
-        path.m_points[order-i+1] = t;
-        path.m_polygons[order-i-1] = m_polygonCache[i];
+        points[order-i+1] = t;
+        polygons[order-i-1] = polygonCache[i];
         
-        t = m_validateCache[i*2];
+        t = validateCache[i*2];
     }
     
-    path.m_points[0] = source;
-    path.m_points[1] = t;
+    points[0] = source;
+    points[1] = t;
     
-    // Finally remove similar paths to dodge bad geometry
+    // Reciprocal paths are found from the listener, store them from the source
+    if( m_reciprocal )
+    {
+        for( int i=0, j=order+1; i < j; i++, j-- ){ swap(points[i], points[j]); }
+        for( int i=0, j=order-1; i < j; i++, j-- ){ swap(polygons[i], polygons[j]); }
+    }
     
-    float fval = dot(path.m_points[1], Vector3(1.f, 1.f, 1.f));
-    float fmin = fval - 2.f*EPS_SIMILAR_PATHS;
-    float fmax = fval + 2.f*EPS_SIMILAR_PATHS;
+    entry.m_key = m_pathKeySeed;
+    for( int i=0; i < order; i++ ){ entry.m_key = hashPathKey(entry.m_key, polygons[i]->getID()); }
     
-    for( std::multimap<float, int>::const_iterator it = m_pathFirstSet.upper_bound(fmin); it != m_pathFirstSet.end() && it->first <= fmax; ++it )
+    worker.m_paths.push_back(entry);
+}
+
+void PathSolution::mergePaths(const Worker& worker, int first, int end)
+{
+    for( int k=first; k < end; k++ )
     {
-        int i = it->second;
+        const PathEntry& candidate = worker.m_paths[k];
+        
+        Path path;
+        path.m_order    = candidate.m_order;
+        path.m_points   = &worker.m_pathPoints[candidate.m_firstPoint];
+        path.m_polygons = candidate.m_order ? &worker.m_pathPolygons[candidate.m_firstPolygon] : 0;
         
-        const Path& p = m_paths[i];
-        if (p.m_order != order){ continue; }
+        // Finally remove similar paths to dodge bad geometry
+        if( findSimilarPath(path) ){ continue; }
         
-        bool safe = false;
-        for( int j=1; j < (int)p.m_points.size()-1; j++ )
+        PathEntry entry = candidate;
+        entry.m_firstPoint   = m_pathPoints.size();
+        entry.m_firstPolygon = m_pathPolygons.size();
+        m_pathPoints.insert(m_pathPoints.end(), path.m_points, path.m_points + path.numPoints());
+        m_pathPolygons.insert(m_pathPolygons.end(), path.m_polygons, path.m_polygons + path.m_order);
+        
+        m_paths.push_back(entry);
+        insertPathHash(m_paths.size()-1);
+    }
+}
+
+bool PathSolution::findSimilarPath(const Path& path) const
+{
+    if( m_pathHash.empty() ){ return false; }
+    
+    unsigned int mask = m_pathHash.size()-1;
+    const Vector3& p = path.m_points[1];
+    
+    // Visit every cell a similar first reflection point could fall in
+    int mn[3], mx[3];
+    for( int k=0; k < 3; k++ )
+    {
+        mn[k] = getPathCell(p[k] - EPS_SIMILAR_PATHS);
+        mx[k] = getPathCell(p[k] + EPS_SIMILAR_PATHS);
+    }
+    
+    for( int x=mn[0]; x <= mx[0]; x++ )
+    for( int y=mn[1]; y <= mx[1]; y++ )
+    for( int z=mn[2]; z <= mx[2]; z++ )
+    {
+        // Linear probing, colliding cells are rejected by the comparison
+        for( unsigned int h = hashPathCell(x, y, z) & mask; m_pathHash[h].m_stamp == m_pathHashStamp; h = (h+1) & mask )
         {
-            if( (p.m_points[j] - path.m_points[j]).lengthSqr() > EPS_SIMILAR_PATHS * EPS_SIMILAR_PATHS )
-            {
-                safe = true;
-                break;
-            }
+            if( isSimilarPath(getPath(m_pathHash[h].m_path), path) ){ return true; }
         }
-        if( !safe ){ return; }
     }
-    
-    m_pathFirstSet.insert(std::pair<float,int>(fval, m_paths.size()));
-    m_paths.push_back(path);
+    return false;
 }
 
-void PathSolution::solveRecursive(const Vector3& source,
-                                  const Vector3& target,
-                                  const Beam& beam,
-                                  int order,
-                                  int parentIndex)
+void PathSolution::insertPathHash(int pathIndex)
 {
-    /*
-     if (order == 0)
-     {
-     printf ("solveRecursive () IN\n");
-     }
-     */
-    // Forced stop
-    if( stop_signal )
+    // Keep the load factor below one half, growing rehashes the current paths
+    if( 2*(pathIndex+1) > (int)m_pathHash.size() )
     {
-        printf ("Stop signal catch 1\n");
-        return;
+        int size = PATH_HASH_MIN_SIZE;
+        while( size < 4*(pathIndex+1) ){ size *= 2; }
+        
+        PathHashEntry empty;
+        empty.m_stamp = 0;
+        empty.m_path  = -1;
+        m_pathHash.assign(size, empty);
+        
+        for( int i=0; i < pathIndex; i++ ){ insertPathHash(i); }
     }
     
-    // Start with the optimal fail plane
-    m_failPlanes.push_back(getFailPlane(beam, target));
+    unsigned int mask = m_pathHash.size()-1;
+    const Vector3& p = m_pathPoints[m_paths[pathIndex].m_firstPoint + 1];
+    
+    unsigned int h = hashPathCell(getPathCell(p.x), getPathCell(p.y), getPathCell(p.z)) & mask;
+    while( m_pathHash[h].m_stamp == m_pathHashStamp ){ h = (h+1) & mask; }
     
-    // Recursion max depth reached?
-    if( order >= m_maximumOrder ){ return; }
+    m_pathHash[h].m_stamp = m_pathHashStamp;
+    m_pathHash[h].m_path  = pathIndex;
+}
+
+void BeamTree::expandBeam(const BeamNode& node, int order)
+{
+    const Vector3& source = node.m_source;
+    const Beam& beam = node.m_beam;
+    int parentIndex = node.m_node;
     
     // Find the polygons intersecting the beam
     std::vector<const Polygon*> polygons;
@@ -496,11 +1421,11 @@ void PathSolution::solveRecursive(const Vector3& source,
     // For each polygon in the beam
     for( int i=(int)polygons.size()-1; i >= 0; i-- )
     {
-        if( stop_signal )
-        {
-            printf ("Stop signal catch 2\n");
-            break;
-        }
+        // Cancelled, the partially expanded order is never published
+        if( isCancelled() ){ break; }
+        
+        // Out of nodes, the tree is truncated by solve()
+        if( m_nodeLimit > 0 && (int)m_solutionNodes.size() >= m_nodeLimit ){ break; }
         
         const Polygon* orig = polygons[i];
         // Construct image source
@@ -511,7 +1436,7 @@ void PathSolution::solveRecursive(const Vector3& source,
         {
             // Test for cases where the parent polygon is the same as the
             // current polygon or the image sources match
-            const Polygon* ppoly = m_solutionNodes[parentIndex].m_polygon;
+            const Polygon* ppoly = getPolygon(parentIndex);
             if( orig == ppoly ){ continue; }
             
             Vector3 testSource = mirror(imgSource, ppoly->getPleq());
@@ -528,42 +1453,245 @@ void PathSolution::solveRecursive(const Vector3& source,
         // Create a new beam from the images source and the polygon
         Beam b(imgSource, poly);
         
-        // Create a new solution node
-        SolutionNode node;
-        node.m_polygon = orig;
-        node.m_parent  = parentIndex;
-        m_solutionNodes.push_back(node);
+        // Create a new solution node, starting with the optimal fail plane
+        SolutionNode child;
+        child.m_polygon = orig->getID();
+        child.m_parent  = parentIndex;
+        m_solutionNodes.push_back(child);
+        m_failPlanes.push_back(packFailPlane(getFailPlane(b, m_target)));
+        
+        // Queue the child for the next order unless max depth is reached,
+        // the frontier keeps only the node and rebuilds the beam from it
+        if( order+1 < m_maximumOrder )
+        {
+            if( m_bestFirst )
+            {
+                BeamNode next;
+                next.m_node   = m_solutionNodes.size()-1;
+                next.m_order  = order+1;
+                next.m_source = imgSource;
+                next.m_beam   = b;
+                queueBeam(next);
+            }
+            else { m_nextFrontier.push_back(m_solutionNodes.size()-1); }
+        }
+    }
+}
+
+bool BeamTree::solveBestFirst(float timeBudget, int nodeBudget)
+{
+    double startTime = getTime();
+    int numExpanded = 0;
+    
+    while( !m_queue.empty() )
+    {
+        // Forced stop, the nodes of this call are never published
+        if( isCancelled() )
+        {
+            printf ("Killed solution calculation\n");
+            return false;
+        }
+        
+        // Out of nodes: publish what there is and stop
+        if( m_nodeLimit > 0 && (int)m_solutionNodes.size() >= m_nodeLimit )
+        {
+            publishBestFirst();
+            m_truncated = true;
+            printf ("Node limit reached, beam tree truncated at order %d with %d nodes\n", m_completedOrder, getNumNodes());
+            break;
+        }
         
-        // Solve recursively the child beam
-        solveRecursive(imgSource, target, b, order+1, m_solutionNodes.size()-1);
+        // Out of budget? Always expand at least one beam per call
+        if( numExpanded > 0 )
+        {
+            if( (nodeBudget > 0 && numExpanded >= nodeBudget) ||
+                (timeBudget > 0.f && getTime() - startTime >= timeBudget) )
+            {
+                publishBestFirst();
+                return false;
+            }
+        }
         
-        /*
-         if (order==0) {
-         printf("building beam tree.. %.2f %% (%.2f Mb)\r",
-         100.f-(float)i/(float)polygons.size()*100.f,
-         m_solutionNodes.size() * sizeof(SolutionNode) /
-         1048576.0);
-         }
-         */
+        // Take the beam with the shortest path out of the queue
+        std::pop_heap(m_queue.begin(), m_queue.end(), std::greater< std::pair<float, int> >());
+        int slot = m_queue.back().second;
+        m_queue.pop_back();
+        m_freeSlots.push_back(slot);
+        
+        BeamNode node = m_queuedBeams[slot];
+        m_numQueued[node.m_order]--;
+        expandBeam(node, node.m_order);
+        numExpanded++;
+    }
+    
+    publishBestFirst();
+    
+    // Release the beams
+    std::vector<BeamNode>().swap(m_queuedBeams);
+    std::vector<int>().swap(m_freeSlots);
+    std::vector< std::pair<float, int> >().swap(m_queue);
+    
+    if( m_cache && !m_truncated ){ m_cache->copy(*this, m_cacheData); }
+    return true;
+}
+
+void BeamTree::queueBeam(const BeamNode& node)
+{
+    int slot;
+    if( m_freeSlots.empty() )
+    {
+        slot = m_queuedBeams.size();
+        m_queuedBeams.push_back(node);
+    }
+    else
+    {
+        slot = m_freeSlots.back();
+        m_freeSlots.pop_back();
+        m_queuedBeams[slot] = node;
+    }
+    
+    m_queue.push_back(std::make_pair(getBeamDistance(node.m_beam, m_target), slot));
+    std::push_heap(m_queue.begin(), m_queue.end(), std::greater< std::pair<float, int> >());
+    m_numQueued[node.m_order]++;
+}
+
+void BeamTree::publishBestFirst(void)
+{
+    if( m_clusterNodes ){ clusterNodes(m_numPublishedNodes); }
+    m_numPublishedNodes = m_solutionNodes.size();
+    
+    // All the nodes up to the order of the lowest waiting beam exist
+    m_completedOrder = m_maximumOrder;
+    for( int i=0; i < m_maximumOrder; i++ )
+    {
+        if( m_numQueued[i] > 0 ){ m_completedOrder = i; break; }
+    }
+}
+
+Vector3 BeamTree::getImageSource(int nodeIndex)
+{
+    m_chain.clear();
+    for( int i = nodeIndex; i > 0; i = m_solutionNodes[i].m_parent ){ m_chain.push_back(getPolygon(i)); }
+    
+    // Mirror from the root down
+    Vector3 imgSource = m_source;
+    for( int i=(int)m_chain.size()-1; i >= 0; i-- ){ imgSource = mirror(imgSource, m_chain[i]->getPleq()); }
+    return imgSource;
+}
+
+void BeamTree::buildBeam(int nodeIndex, BeamNode& node)
+{
+    // The siblings follow each other in the frontier, the beam of their
+    // parent is rebuilt only once for all of them
+    int parentIndex = nodeIndex > 0 ? m_solutionNodes[nodeIndex].m_parent : -1;
+    if( parentIndex != m_parentBeam->m_node )
+    {
+        // Polygons from the parent up to the root
+        m_chain.clear();
+        for( int i = parentIndex; i > 0; i = m_solutionNodes[i].m_parent ){ m_chain.push_back(getPolygon(i)); }
+        
+        m_parentBeam->m_node   = parentIndex;
+        m_parentBeam->m_order  = m_chain.size();
+        m_parentBeam->m_source = m_source;
+        m_parentBeam->m_beam   = Beam();
+        for( int i=(int)m_chain.size()-1; i >= 0; i-- ){ extendBeam(*m_parentBeam, *m_chain[i]); }
+    }
+    
+    node = *m_parentBeam;
+    node.m_node = nodeIndex;
+    if( nodeIndex > 0 )
+    {
+        node.m_order++;
+        extendBeam(node, *getPolygon(nodeIndex));
+    }
+    else { node.m_order = 0; }
+}
+
+void BeamTree::extendBeam(BeamNode& node, const Polygon& polygon)
+{
+    // Clip and mirror the way expandBeam() built the beam on the way
+    Polygon poly = polygon;
+    poly.clip(node.m_beam);
+    node.m_source = mirror(node.m_source, polygon.getPleq());
+    node.m_beam   = Beam(node.m_source, poly);
+}
+
+void BeamTree::prioritizeFrontier(void)
+{
+    // Expand the beams of the closest image sources first, their paths are
+    // the shortest and the loudest
+    std::vector< std::pair<float, int> > order(m_frontier.size());
+    for( int i=0; i < (int)m_frontier.size(); i++ )
+    {
+        order[i] = std::make_pair((getImageSource(m_frontier[i]) - m_target).lengthSqr(), i);
     }
-    /*
-     if (order==0)
-     printf("\n");
-     */
-    /*
-     if (order == 0)
-     {
-     printf ("solveRecursive () OUT\n");
-     }
-     */
+    std::sort(order.begin(), order.end());
+    
+    std::vector<int> frontier(m_frontier.size());
+    for( int i=0; i < (int)order.size(); i++ ){ frontier[i] = m_frontier[order[i].second]; }
+    m_frontier.swap(frontier);
 }
 
+void BeamTree::clusterNodes(int first)
+{
+    int n = m_solutionNodes.size();
+    if( n - first < 2 ){ return; }
+    
+    float reach = m_reach > 0.f ? m_reach : 1.f;
+    
+    // Sort the new nodes by order, so that the parents stay before their
+    // children in the best-first batches that mix orders, then by the
+    // codes of their fail planes, ties in creation order
+    typedef std::pair<int, unsigned long long> Key;
+    std::vector< std::pair<Key, int> > order(n - first);
+    for( int i=first; i < n; i++ )
+    {
+        int depth = 0;
+        for( int j = i; j > 0; j = m_solutionNodes[j].m_parent ){ depth++; }
+        
+        const FailPlane& plane = m_failPlanes[i];
+        order[i-first] = std::make_pair(Key(depth, getPlaneCode(plane.m_u, plane.m_v, plane.m_offset, reach)), i);
+    }
+    std::sort(order.begin(), order.end());
+    
+    // Move the nodes, the parents published earlier stay put
+    std::vector<SolutionNode> nodes(n - first);
+    std::vector<FailPlane> planes(n - first);
+    std::vector<int> remap(n - first);
+    for( int i=0; i < n - first; i++ )
+    {
+        int j = order[i].second;
+        nodes[i]  = m_solutionNodes[j];
+        planes[i] = m_failPlanes[j];
+        remap[j-first] = first + i;
+    }
+    for( int i=0; i < n - first; i++ )
+    {
+        m_solutionNodes[first+i] = nodes[i];
+        m_failPlanes[first+i]    = planes[i];
+        
+        // Best-first batches mix orders, parents in the batch moved too
+        int parent = m_solutionNodes[first+i].m_parent;
+        if( parent >= first ){ m_solutionNodes[first+i].m_parent = remap[parent - first]; }
+    }
+    
+    // The beams queued for the next order refer to the moved nodes
+    for( int i=0; i < (int)m_nextFrontier.size(); i++ )
+    {
+        m_nextFrontier[i] = remap[m_nextFrontier[i] - first];
+    }
+    for( int i=0; i < (int)m_queue.size(); i++ )
+    {
+        BeamNode& beam = m_queuedBeams[m_queue[i].second];
+        if( beam.m_node >= first ){ beam.m_node = remap[beam.m_node - first]; }
+    }
+}
 
-float PathSolution::getLength(const Path& path)
+float PathSolution::getLength(const Path& path) const
 {
     float len = 0;
     
-    for( int j=0; j < path.m_points.size()-1; j++ )
+    for( int j=0; j < path.numPoints()-1; j++ )
     {
         const EL::Vector3& p0 = path.m_points[j];
         const EL::Vector3& p1 = path.m_points[j+1];
@@ -588,10 +1716,10 @@ void PathSolution::print (int minOrder, int maxOrder, int maxAmount)
         if( (path.m_order < minOrder) || (path.m_order > maxOrder) ){ continue; }
         pathCount++;
         
-        printf ("%ld (", path.m_points.size () - 2 );
+        printf ("%d (", path.m_order );
         
         for( k = 0; k < 10; k++ ){ reflectance[k] = 1.0; }
-        for( i = 0; i < path.m_points.size () - 1; i++ )
+        for( i = 0; i < path.numPoints () - 1; i++ )
         {
             printf ("[%.5f %.5f %.5f]-", path.m_points[i].x, path.m_points[i].y, path.m_points[i].z);
             
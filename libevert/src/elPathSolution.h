@@ -39,6 +39,9 @@
 #	include "elVector.h"
 #endif
 
+#include <atomic>
+#include <string>
+
 //#define SUPER_VECTOR
 
 #ifdef SUPER_VECTOR
@@ -48,51 +51,317 @@
 namespace EL
 {
 
-static bool stop_signal;
-inline void setStopSignalValue( bool value ){ stop_signal = value; };
-inline bool getStopSignalValue( ){ return stop_signal; };
-    
 //------------------------------------------------------------------------
 
 class Beam;
+class BeamTreeCache;
 class Listener;
 class Polygon;
 class Room;
+class RoomSnapshot;
 class Source;
 
+// Beam tree of a source, it depends only on the room and the source
+// position and is shared by the path solutions of all the listeners
+class BeamTree
+{
+    
+public:
+    
+    // The initial fail planes of the nodes are chosen for the target, any
+    // listener position remains valid
+    BeamTree (const Room& room, const Vector3& source, const Vector3& target, int maximumOrder);
+    
+    // A tree built on a shared room holds a reference to it
+    BeamTree (const RoomSnapshot& room, const Vector3& source, const Vector3& target, int maximumOrder);
+    
+    ~BeamTree (void);
+    
+    // Build the tree breadth-first, one reflection order after the other.
+    // Returns false when the time (seconds) or node budget ran out before the
+    // maximum order was reached; call again to continue. A zero budget means
+    // no limit. Completed orders are immediately visible to the solutions.
+    bool solve (float timeBudget = 0.f, int nodeBudget = 0);
+    
+    // Build the tree best-first instead, always expanding the beam with the
+    // lowest bound for the length of its paths to the target, so that a
+    // budget, a node limit or a cancel leaves the shortest and loudest
+    // reflections computed: every path shorter than the bound of the next
+    // waiting beam is in the tree. The nodes are visible to the solutions at
+    // the end of each solve() call, the completed order is the lowest one
+    // with beams left to expand. Set before the first solve()
+    void setBestFirst (bool enabled) { m_bestFirst = enabled; }
+    
+    // Load the tree from the cache on the first solve() when it holds a
+    // tree of this room, exact source position and order. The solve()
+    // call that completes the tree keeps a copy of it when it is not
+    // truncated, saveToCache() writes the copy; no file I/O is done in
+    // solve(), so a caller solving under a lock saves after releasing it
+    void setCache (const BeamTreeCache* cache) { m_cache = cache; }
+    bool saveToCache (void);
+    
+    // Ask a running solve() to return as soon as possible, may be called
+    // from any thread. A cancelled tree keeps its completed orders but
+    // is never extended further.
+    void cancel (void) { m_cancelled.store(true); }
+    bool isCancelled (void) const { return m_cancelled.load(); }
+    
+    const Room& getRoom (void) const { return m_room; }
+    const Vector3& getSource (void) const { return m_source; }
+    int getOrder (void) const { return m_maximumOrder; }
+    int getCompletedOrder (void) const { return m_completedOrder; }
+    bool isComplete (void) const { return m_completedOrder >= m_maximumOrder || m_truncated; }
+    
+    // Stop growing the tree at this many nodes. The beams of the closest
+    // image sources are expanded first, and the order being expanded when
+    // the limit is hit is published partially as the last one, the tree is
+    // then truncated. Zero (the default) means no limit. The number of
+    // nodes may be read while another thread solves the tree
+    void setNodeLimit (int maxNodes) { m_nodeLimit = maxNodes; }
+    bool isTruncated (void) const { return m_truncated; }
+    int getNumNodes (void) const { return m_numPublishedNodes; }
+    
+    // Bytes held by the nodes of the tree
+    size_t getMemorySize (void) const;
+    
+    // Sort the nodes of each completed order by their fail planes, so that
+    // the skip buckets of the solutions hold nodes of similar planes. On by
+    // default, set before the first solve()
+    void setNodeClustering (bool enabled) { m_clusterNodes = enabled; }
+    
+    // The tree is deleted with its last reference
+    void addReference (void) { m_references++; }
+    void removeReference (void) { if( --m_references == 0 ){ delete this; } }
+    
+    
+private:
+    
+    friend class PathSolution;
+    friend class BeamTreeCache;
+    
+    BeamTree (const BeamTree&);	// prohibit
+    const BeamTree& operator= (const BeamTree&);	// prohibit
+    
+    struct SolutionNode;
+    struct BeamNode;
+    
+    // Fail plane packed into 8 bytes: the normal octahedral-encoded with 16
+    // bits per component, and the offset from the room center pushed out so
+    // that the packed plane never puts a target within m_reach of the center
+    // on the failing side when the exact plane does not
+    struct FailPlane
+    {
+        unsigned short m_u;
+        unsigned short m_v;
+        float m_offset;
+    };
+    
+    void initialize (void);
+    void expandBeam (const BeamNode& node, int order);
+    void buildBeam (int nodeIndex, BeamNode& node);
+    void extendBeam (BeamNode& node, const Polygon& polygon);
+    Vector3 getImageSource (int nodeIndex);
+    void clusterNodes (int first);
+    void prioritizeFrontier (void);
+    
+    bool solveBestFirst (float timeBudget, int nodeBudget);
+    void queueBeam (const BeamNode& node);
+    void publishBestFirst (void);
+    
+    const Polygon* getPolygon (int nodeIndex) const;
+    FailPlane packFailPlane (const Vector4& plane) const;
+    
+    static Vector4 getFailPlane	(const Beam& beam, const Vector3& target);
+    
+    const Room& m_room;
+    const RoomSnapshot* m_snapshot;
+    Vector3 m_source;
+    Vector3 m_target;
+    Vector3 m_center;
+    float m_reach;
+    int m_maximumOrder;
+    std::atomic<bool> m_cancelled;
+    std::atomic<int> m_references;
+    bool m_clusterNodes;
+    int m_nodeLimit;
+    bool m_truncated;
+    bool m_bestFirst;
+    const BeamTreeCache* m_cache;
+    std::vector<char> m_cacheData;
+    
+#ifndef SUPER_VECTOR
+    std::vector<SolutionNode> m_solutionNodes;
+    std::vector<FailPlane> m_failPlanes;
+#else
+    SuperVector<SolutionNode> m_solutionNodes;
+    SuperVector<FailPlane> m_failPlanes;
+#endif
+    
+    // Nodes of the order being expanded and of the next one, their beams
+    // are rebuilt from the chain of parents when expanded so that the
+    // frontier does not grow with the beams of a whole order
+    std::vector<int> m_frontier;
+    std::vector<int> m_nextFrontier;
+    int m_frontierPos;
+    std::vector<const Polygon*> m_chain;
+    BeamNode* m_parentBeam;
+    
+    // Best-first: beams waiting in slots of m_queuedBeams, a min-heap of
+    // their path lengths and slots, and the number waiting of each order
+    std::vector<BeamNode> m_queuedBeams;
+    std::vector<int> m_freeSlots;
+    std::vector< std::pair<float, int> > m_queue;
+    std::vector<int> m_numQueued;
+    int m_completedOrder;
+    
+    // Read by other threads to share a total node limit among the trees
+    std::atomic<int> m_numPublishedNodes;
+};
+
+// Beam trees stored in a directory, one memory-mappable file per room hash,
+// source position quantized on a grid (metres) and order, so that static
+// sources come back to full order at once after a restart or a reload of
+// the same geometry. A file holds the tree of the last exact source saved
+// in its grid cell, the fail planes of the nodes are only valid for that
+// source. Files are replaced atomically, a cache directory may be shared
+// by several processes
+class BeamTreeCache
+{
+    
+public:
+    
+    BeamTreeCache (const char* directory, float gridSize = 0.001f);
+    ~BeamTreeCache (void);
+    
+    // Fill an initialized tree from its file, false when there is none
+    bool load (BeamTree& tree) const;
+    
+    // Copy a complete tree into the contents of its file, then write them
+    void copy (const BeamTree& tree, std::vector<char>& data) const;
+    bool save (const std::vector<char>& data) const;
+    
+    
+private:
+    
+    struct Header;
+    
+    std::string getFileName (const Header& key) const;
+    void getKey (const BeamTree& tree, Header& header) const;
+    
+    std::string m_directory;
+    float m_gridSize;
+};
+
+// Threads sharing the work of PathSolution::update(), started once and
+// reused by every update. The calling thread counts as one of them. A pool
+// may be shared by the solutions updated one after the other from a thread
+class UpdatePool
+{
+    
+public:
+    
+    UpdatePool (int numThreads);
+    ~UpdatePool (void);
+    
+    int getNumThreads (void) const { return m_numThreads; }
+    
+    // Call function(data, i) for each thread i, the calling thread is the
+    // first one, and return once all the calls returned
+    void run (void (*function)(void*, int), void* data);
+    
+    
+private:
+    
+    UpdatePool (const UpdatePool&);	// prohibit
+    const UpdatePool& operator= (const UpdatePool&);	// prohibit
+    
+    struct State;
+    static void* runThread (void* data);
+    
+    int m_numThreads;
+    State* m_state;
+};
+
+// Paths from a source to a listener, validated on the beam tree of the
+// source with fail planes of the listener's own
 class PathSolution
 {
     
 public:
     
+    // Lightweight view of a path stored in the solution's path buffers,
+    // valid until the next update()
     struct Path
     {
         int m_order;
-        std::vector<Vector3> m_points;
-        std::vector<const Polygon*>	m_polygons;
+        const Vector3* m_points;           // m_order+2 points, source first
+        const Polygon* const* m_polygons;  // m_order reflecting polygons
+        
+        int numPoints (void) const { return m_order+2; }
     };
     
+    // Identity of a path, the same for the same source, listener and
+    // sequence of reflecting polygons across updates and solutions
+    typedef unsigned long long PathKey;
+    
+    // Solution with a beam tree of its own
     PathSolution (const Room& room, const Source& source, const Listener& listener, int maximumOrder, bool changed);
     
+    // Solution on a shared beam tree, built for the source position. A
+    // reciprocal solution uses a tree built for the listener position and
+    // validates towards the source, the paths still start at the source.
+    PathSolution (BeamTree* tree, const Source& source, const Listener& listener, bool changed, bool reciprocal = false);
+    
     ~PathSolution (void);
     
-    void solve (void);
+    // Solves the tree and saves it to its cache once complete
+    bool solve (float timeBudget = 0.f, int nodeBudget = 0);
     void update (void);
     
+    // Validate on up to this many threads, the skip buckets of a large tree
+    // are shared among them. The paths are the same as with the default of
+    // updating on the calling thread only. The threads of a pool set with
+    // setUpdatePool() are shared with other solutions, the ones of
+    // setNumThreads() belong to the solution
+    void setNumThreads (int numThreads);
+    void setUpdatePool (UpdatePool* pool);
+    
+    void cancel (void) { m_tree->cancel(); }
+    bool isCancelled (void) const { return m_tree->isCancelled(); }
+    BeamTree* getBeamTree (void) const { return m_tree; }
+    bool isReciprocal (void) const { return m_reciprocal; }
+    
     int numPaths (void) const { return m_paths.size(); }
     
-    const Path& getPath (int i) const
-    { EL_ASSERT(i >= 0 && i < numPaths()); return m_paths[i]; }
+    Path getPath (int i) const
+    {
+        EL_ASSERT(i >= 0 && i < numPaths());
+        const PathEntry& e = m_paths[i];
+        Path path;
+        path.m_order    = e.m_order;
+        path.m_points   = &m_pathPoints[e.m_firstPoint];
+        path.m_polygons = e.m_order ? &m_pathPolygons[e.m_firstPolygon] : 0;
+        return path;
+    }
+    
+    PathKey getPathKey (int i) const { EL_ASSERT(i >= 0 && i < numPaths()); return m_paths[i].m_key; }
+    
+    // Occluded paths found by the updates so far, and how many of them the
+    // occluder cached per node caught without a ray cast
+    int getNumOccludedPaths (void) const { return m_numOccludedPaths; }
+    int getNumOccluderCacheHits (void) const { return m_numOccluderCacheHits; }
     
     const Listener & getListener (void) { return m_listener; }
     const Source & getSource (void) { return m_source; }
     
-    int getOrder (void) { return m_maximumOrder; }
+    int getOrder (void) { return m_tree->getOrder(); }
+    int getCompletedOrder (void) const { return m_tree->getCompletedOrder(); }
+    bool isComplete (void) const { return m_tree->isComplete(); }
     void renderPath (const Path& path) const;
     bool save (char *filename, char *modelname);
     
     void print (int minOrder, int maxOrder, int maxAmount);
-    float getLength (const Path& path);
+    float getLength (const Path& path) const;
     inline bool getChanged (void) { return m_changed; }
     
     
@@ -101,38 +370,75 @@ private:
     PathSolution (const PathSolution&);	// prohibit
     const PathSolution&	operator= (const PathSolution&);	// prohibit
     
-    struct SolutionNode;
+    struct PathHashEntry;
+    struct Worker;
+    struct UpdateUnit;
     
-    void solveRecursive	(const Vector3& source, const Vector3& target, const Beam& beam, int order, int parentIndex);
+    // Offsets of a valid path into the path buffers
+    struct PathEntry
+    {
+        PathKey m_key;
+        int m_order;
+        int m_firstPoint;
+        int m_firstPolygon;
+    };
     
-    void validatePath (const Vector3& source, const Vector3& target, int nodeIndex, Vector4& failPlane);
+    void initialize (void);
+    void validatePath (const Vector3& source, const Vector3& target, int nodeIndex, BeamTree::FailPlane& failPlane, Worker& worker);
+    void mergePaths (const Worker& worker, int first, int end);
     
-    static Vector4 getFailPlane	(const Beam& beam, const Vector3& target);
+    float updateSkipSphere (int level, int index, const Vector3& source, const Vector3& target, Worker& worker);
+    float combineSkipSpheres (int level, int index, const Vector3& target, bool collect);
+    void updateParallel (const Vector3& source, const Vector3& target);
+    static void runWorker (void* data, int index);
     
-    void clearCache	(void);
+    bool findSimilarPath (const Path& path) const;
+    void insertPathHash (int pathIndex);
     
-    const Room& m_room;
+    BeamTree* m_tree;
     const Source& m_source;
     const Listener& m_listener;
-    int m_maximumOrder;
     bool m_changed;
+    bool m_reciprocal;
     
-    std::vector<const Polygon*> m_polygonCache;
-    std::vector<Vector3> m_validateCache;
-    std::multimap<float, int> m_pathFirstSet;
+    // Threads of update(), the first one is the calling thread, and the
+    // units of work of a parallel update taken in turn by them
+    int m_numThreads;
+    UpdatePool* m_pool;
+    bool m_ownPool;
+    std::vector<Worker*> m_workers;
+    std::vector<UpdateUnit> m_units;
+    std::atomic<int> m_nextUnit;
+    int m_unitLevel;
+    int m_unitCursor;
     
-#ifndef SUPER_VECTOR
-    std::vector<SolutionNode> m_solutionNodes;
-    std::vector<Vector4> m_failPlanes;
-#else
-    SuperVector<SolutionNode> m_solutionNodes;
-    SuperVector<Vector4> m_failPlanes;
-#endif
+    // Spatial hash of the first reflection points of the valid paths,
+    // entries of earlier updates are invalidated by bumping the stamp
+    std::vector<PathHashEntry> m_pathHash;
+    unsigned int m_pathHashStamp;
+    
+    // Fail planes of the listener, the nodes published since the last
+    // update start from the ones of the tree
+    std::vector<BeamTree::FailPlane> m_failPlanes;
+    
+    // Skip spheres of the buckets of nodes on level zero, and of groups of
+    // the spheres below on the other levels, up to a single sphere. A sphere
+    // holds its center and radius, a zero radius never skips
+    std::vector< std::vector<Vector4> > m_distanceSkipCache;
+    int m_numSkipCacheNodes;
+    
+    // Polygon that last blocked the path of each node, or null
+    std::vector<const Polygon*> m_occluders;
+    int m_numOccludedPaths;
+    int m_numOccluderCacheHits;
     
-    std::vector<Vector4> m_distanceSkipCache;
-    Vector3 m_cachedSource;
+    // Valid paths, kept in flat buffers reused from one update to the next
+    std::vector<PathEntry> m_paths;
+    std::vector<Vector3> m_pathPoints;
+    std::vector<const Polygon*> m_pathPolygons;
     
-    std::vector<Path> m_paths;
+    // Key of the source and listener, the path keys start from it
+    PathKey m_pathKeySeed;
 };
     
 } // namespace EL
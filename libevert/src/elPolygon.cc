@@ -507,7 +507,7 @@ AABB Polygon::getAABB(void) const
 
 //------------------------------------------------------------------------
 
-std::vector<Vector3> Polygon::s_clipBuffer[2];
+thread_local std::vector<Vector3> Polygon::s_clipBuffer[2];
 EL_FORCE_INLINE Polygon::ClipResult Polygon::clipInner(const Vector3* inPoints, int numInPoints,
                                                        Vector3* outPoints, int& numOutPoints,
                                                        const Vector4& pleq)
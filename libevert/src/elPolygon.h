@@ -112,7 +112,7 @@ public:
     EL_FORCE_INLINE void setMaterial (Material material) { m_material = material; }
     EL_FORCE_INLINE Material getMaterial (void) const { return m_material; }
     
-    EL_FORCE_INLINE void setID (unsigned long id) { m_id = id; std::cout << id << std::endl; }
+    EL_FORCE_INLINE void setID (unsigned long id) { m_id = id; }
     EL_FORCE_INLINE unsigned long getID (void) const { return m_id; }
     
     EL_FORCE_INLINE std::string getName (void) const { return m_name; }
@@ -128,7 +128,7 @@ private:
     
     static ClipResult clipInner	(const Vector3* inPoints, int numInPoints, Vector3* outPoints, int& numOutPoints, const Vector4& pleq);
     
-    static std::vector<Vector3> s_clipBuffer[2];
+    static thread_local std::vector<Vector3> s_clipBuffer[2];	// clipper workspace of each thread
     std::vector<Vector3> m_points;
     Vector4 m_pleq;
     Material m_material;
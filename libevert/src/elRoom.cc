@@ -35,6 +35,7 @@
 #include "elBSP.h"
 #include "elRoom.h"
 #include <cstdio>
+#include <cstring>
 
 #ifdef __Darwin
     #include <OpenGL/glu.h>
@@ -47,7 +48,7 @@
 using namespace EL;
 
 
-Room::Room(void): m_bsp(0) {}
+Room::Room(void): m_bsp(0), m_hash(0) {}
 
 Room::~Room(void)
 {
@@ -158,11 +159,14 @@ bool Room::import(const char* filename, MaterialFile& materials)
     std::vector<const Polygon*> polygons;
     for( int i=0; i < numConvexElements(); i++ )
     {
+        // The convex element index identifies the polygon in the paths
+        getConvexElement(i).m_polygon.setID(i);
         polygons.push_back(&getConvexElement(i).m_polygon);
     }
     
     m_bsp = new BSP();
     m_bsp->constructHierarchy(&polygons[0], polygons.size());
+    computeHash();
     
     return true;
 }
@@ -180,6 +184,7 @@ bool Room::setElements(std::vector<Element> &elements)
         delete m_bsp;
         m_bsp = 0;
     }
+    m_hash = 0;
     
     if( elements.size () == 0 ){ return true; }
     
@@ -206,11 +211,13 @@ bool Room::setElements(std::vector<Element> &elements)
     std::vector<const Polygon*> polygons;
     for( int i = 0; i < numConvexElements(); i++ )
     {
+        getConvexElement(i).m_polygon.setID(i);
         polygons.push_back(&getConvexElement(i).m_polygon);
     }
     
     m_bsp = new BSP();
     m_bsp->constructHierarchy(&polygons[0], polygons.size());
+    computeHash();
     
     return true;
 }
@@ -227,6 +234,27 @@ bool Room::addSource(Source source)
     return true;
 }
 
+void Room::computeHash(void)
+{
+    // FNV-1a over the points of the convex elements in ID order
+    m_hash = 14695981039346656037ull;
+    for( int i=0; i < numConvexElements(); i++ )
+    {
+        const Polygon& poly = getConvexElement(i).m_polygon;
+        unsigned int n = poly.numPoints();
+        for( int j=-1; j < 3*(int)n; j++ )
+        {
+            unsigned int bits = n;
+            if( j >= 0 ){ memcpy(&bits, &poly[j/3][j%3], sizeof(bits)); }
+            for( int k=0; k < 4; k++ )
+            {
+                m_hash ^= (bits >> (8*k)) & 0xff;
+                m_hash *= 1099511628211ull;
+            }
+        }
+    }
+}
+
 //------------------------------------------------------------------------
 
 void Room::getBoundingBox(Vector3& mn, Vector3& mx) const
@@ -50,6 +50,8 @@
 
 #include "material.h"
 
+#include <atomic>
+
 namespace EL
 {
     
@@ -121,16 +123,49 @@ public:
     Vector3 getCenter (void) const;
     
     const BSP& getBSP (void) const { return *m_bsp; }
+    
+    // Hash of the convex elements' geometry, equal for rooms whose beam
+    // trees are equal
+    unsigned long long getHash (void) const { return m_hash; }
     void render (void) const;
     
     
 private:
     
+    void computeHash (void);
+    
     std::vector<Element> m_elements;
     std::vector<Element> m_convexElements;
     std::vector<Source> m_sources;
     std::vector<Listener> m_listeners;
     BSP* m_bsp;
+    unsigned long long m_hash;
+};
+
+// A room shared as an immutable snapshot: its holders take references,
+// each beam tree built on it holds one, and the snapshot is deleted with
+// the last. Fill the room before sharing it
+class RoomSnapshot
+{
+    
+public:
+    
+    RoomSnapshot (void): m_references(0) {}
+    
+    Room& getRoom (void) { return m_room; }
+    const Room& getRoom (void) const { return m_room; }
+    
+    void addReference (void) const { m_references++; }
+    void removeReference (void) const { if( --m_references == 0 ){ delete this; } }
+    
+    
+private:
+    
+    RoomSnapshot (const RoomSnapshot&);	// prohibit
+    const RoomSnapshot& operator= (const RoomSnapshot&);
+    
+    Room m_room;
+    mutable std::atomic<int> m_references;
 };
 
 } // namespace EL